@@ -0,0 +1,111 @@
+import glob
+import mmap
+import os
+import numpy as np
+import cv2
+
+# all the functions reading an image return it like cv2.imread: 3 channels in BGR order, whatever the format the
+# generator wrote it in (PNG or QOI, RGB or grey, files, shards or tensors)
+
+# layout of the shards written by DatasetWriter in opengl_generator/main.cpp, all little-endian
+HEADER_DTYPE = np.dtype([
+    ("magic", "S8"), ("version", "<u4"), ("headerSize", "<u4"), ("entrySize", "<u4"), ("capacity", "<u4"),
+    ("count", "<u8"), ("indexOffset", "<u8"), ("payloadOffset", "<u8"), ("width", "<u4"), ("height", "<u4"),
+    ("fileFormat", "u1"), ("pixelFormat", "u1"), ("reserved", "V6"),
+])
+ENTRY_DTYPE = np.dtype([
+    ("offset", "<u8"), ("length", "<u4"), ("cameraHeight", "<f4"),
+    ("radius", "<f8"), ("sample", "<u8"), ("cameraInclination", "<f4"), ("fovy", "<f4"),
+])
+FILE_FORMAT_QOI = 1
+
+
+class Shard:
+    """a shard file mapped in memory: the index is a numpy record array over the mapping, and images are decoded
+    only when asked for, so opening even millions of samples reads just their headers"""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        self.header = np.frombuffer(self.map, HEADER_DTYPE, 1)[0]
+        if (self.header["magic"] != b"SGSHARD" or self.header["version"] != 2
+                or self.header["entrySize"] != ENTRY_DTYPE.itemsize):
+            raise ValueError(path + " is not a dataset shard")
+        self.index = np.frombuffer(self.map, ENTRY_DTYPE, int(self.header["count"]), int(self.header["indexOffset"]))
+
+    def __len__(self):
+        return len(self.index)
+
+    def encoded(self, i):
+        """the encoded image of sample i, without copying it"""
+        offset, length = int(self.index[i]["offset"]), int(self.index[i]["length"])
+        return memoryview(self.map)[offset:offset + length]
+
+    def image(self, i):
+        """the image of sample i as a BGR array, like cv2.imread"""
+        if self.header["fileFormat"] == FILE_FORMAT_QOI:
+            import qoi # OpenCV cannot read QOI files
+            return cv2.cvtColor(qoi.decode(bytes(self.encoded(i))), cv2.COLOR_RGB2BGR)
+        return cv2.imdecode(np.frombuffer(self.encoded(i), np.uint8), cv2.IMREAD_COLOR)
+
+
+def openShards(path):
+    """all the shards in the dataset directory, in the order they were written"""
+    return [Shard(f) for f in sorted(glob.glob(os.path.join(path, "*.shard")))]
+
+
+def openTensors(path):
+    """the tensors written by TensorDatasetWriter in opengl_generator/main.cpp, memory-mapped: (images, labels,
+    streetRects or None); images are top-down RGB or grey with a single channel, read them with readTensor() to
+    get BGR like from the other formats, and labels hold radius, cameraHeight,
+    cameraInclination, fovy and the sample index, so nothing is decoded nor copied until used. Returns None if there
+    are no tensors"""
+    if not os.path.isfile(os.path.join(path, "images.npy")):
+        return None
+    images = np.load(os.path.join(path, "images.npy"), mmap_mode="r")
+    labels = np.load(os.path.join(path, "labels.npy"), mmap_mode="r")
+    streetRectsPath = os.path.join(path, "streetRects.npy")
+    streetRects = np.load(streetRectsPath, mmap_mode="r") if os.path.isfile(streetRectsPath) else None
+    return images, labels, streetRects
+
+
+def readTensor(array, i):
+    """record i of the images or the streetRects from openTensors() as a BGR array with 3 channels, like
+    cv2.imread; the tensors themselves are RGB or have a single grey channel"""
+    image = np.asarray(array[i])
+    if image.shape[2] == 1:
+        return np.repeat(image, 3, axis=2)
+    return image[:, :, ::-1]
+
+
+class Part:
+    """the samples generated by one `--shard i/N` run of the generator, shards or tensors, addressed by their record
+    number in the merged index"""
+
+    def __init__(self, path):
+        self.tensors = openTensors(path)
+        self.shards = openShards(path) if self.tensors is None else []
+        self.starts = np.cumsum([0] + [len(shard) for shard in self.shards])
+
+    def image(self, record):
+        if self.tensors is not None:
+            return readTensor(self.tensors[0], record)
+        i = int(np.searchsorted(self.starts, record, side="right")) - 1
+        return self.shards[i].image(record - int(self.starts[i]))
+
+    def hasStreetRects(self):
+        return self.tensors is not None and self.tensors[2] is not None
+
+    def streetRect(self, record):
+        return readTensor(self.tensors[2], record)
+
+
+def openIndex(path):
+    """the index written by `--merge` (see mergeParts() in opengl_generator/main.cpp) over the parts of a dataset
+    generated with `--shard i/N`: (index, parts), where index is a record array with a row per sample, in sample order,
+    and parts[p] the Part to look its record up in. Returns None if there is no index"""
+    indexPath = os.path.join(path, "index.npy")
+    if not os.path.isfile(indexPath):
+        return None
+    parts = [Part(p) for p in sorted(glob.glob(os.path.join(path, "part-*-of-*")))]
+    return np.load(indexPath, mmap_mode="r"), parts
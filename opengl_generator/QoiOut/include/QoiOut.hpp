@@ -0,0 +1,86 @@
+/*
+ * QOI Output (C++)
+ *
+ * Writes images in the Quite OK Image format, https://qoiformat.org/qoi-specification.pdf:
+ * a lossless format encoded in a single pass, with no entropy coding, many times faster than PNG.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include "OutputSink.hpp"
+
+
+/*
+ * Takes image pixel data in raw RGB8.8.8 or grey 8 format and writes a QOI file (always with 3 channels) to an
+ * output sink. Each pixel becomes a run of the previous pixel, an index into the last 64 colors seen, a small
+ * difference from the previous pixel, or the full color.
+ */
+class QoiOut final {
+
+	/*---- Public types ----*/
+
+	// The pixel formats that can be written, each value being the number of bytes per pixel
+	public: enum class PixelFormat : std::uint8_t {
+		grey = 1,  // written as RGB with equal components
+		rgb = 3,
+	};
+
+
+
+	/*---- Fields ----*/
+
+	// Immutable configuration
+	private: std::uint32_t width;   // Measured in pixels
+	private: std::uint32_t height;  // Measured in pixels
+	private: PixelFormat pixelFormat;
+	private: OutputSink &output;
+
+	// Running state
+	private: std::uint64_t remaining;  // Number of pixels not yet written
+	private: std::uint32_t previous;   // Last pixel as R | G << 8 | B << 16 | A << 24
+	private: std::uint32_t run;        // Number of pixels equal to 'previous' not yet written (< MAX_RUN)
+	private: std::array<std::uint32_t, 64> index;  // Pixels seen, by their hash
+
+
+
+	/*---- Public constructor and methods ----*/
+
+	/*
+	 * Creates a QOI writer with the given width and height (both non-zero), which writes the header
+	 * to the sink right away. The sink is flushed (but not closed) once the whole image has been written.
+	 */
+	public: explicit QoiOut(std::uint32_t w, std::uint32_t h, OutputSink &out, PixelFormat format = PixelFormat::rgb);
+
+
+	/*
+	 * Writes 'count' pixels from the given array, reading count*3 bytes for RGB and count bytes for grey.
+	 * Pixels are presented from top to bottom, left to right. It is an error to write more pixels
+	 * in total than width*height.
+	 */
+	public: void write(const std::uint8_t pixels[], std::size_t count);
+
+
+	/*
+	 * Writes 'rows' lines starting with the one at 'pixels', each following line being 'stride' bytes after the
+	 * previous one. A negative stride reads lines bottom-up.
+	 */
+	public: void writeRows(const std::uint8_t pixels[], std::uint32_t rows, std::ptrdiff_t stride);
+
+
+
+	/*---- Private members ----*/
+
+	// write() for the given number of bytes per pixel
+	private: template <int BytesPerPixel>
+	void encode(const std::uint8_t pixels[], std::size_t count);
+
+
+	private: static constexpr std::uint32_t MAX_RUN = 62;
+
+	// Size of the chunks in which the encoded bytes are passed to the sink
+	private: static constexpr std::size_t CHUNK_SIZE = 1 << 13;
+
+};
@@ -0,0 +1,186 @@
+/*
+ * QOI Output (C++)
+ *
+ * Writes images in the Quite OK Image format, https://qoiformat.org/qoi-specification.pdf:
+ * a lossless format encoded in a single pass, with no entropy coding, many times faster than PNG.
+ */
+
+#include <cstring>
+#include <stdexcept>
+#include "QoiOut.hpp"
+
+using std::uint8_t;
+using std::uint32_t;
+using std::uint64_t;
+using std::size_t;
+
+
+namespace {
+
+	enum Op : uint8_t {
+		OP_INDEX = 0x00,  // 00xxxxxx: index into the colors seen
+		OP_DIFF = 0x40,   // 01rrggbb: differences of -2..1 from the previous pixel
+		OP_LUMA = 0x80,   // 10gggggg rrrrbbbb: green difference of -32..31, red and blue ones of -8..7 relative to it
+		OP_RUN = 0xC0,    // 11xxxxxx: 1 to 62 repetitions of the previous pixel
+		OP_RGB = 0xFE,    // 11111110 r g b
+	};
+
+	inline uint32_t hashPixel(uint32_t r, uint32_t g, uint32_t b) {
+		return (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;  // Alpha is always 255
+	}
+
+
+	// Returns how many of the 'count' pixels at 'pixels' repeat the pixel just before them (which is read too).
+	// A pixel equals the previous one when each of its bytes equals the one 'bpp' bytes before it,
+	// so the bytes are compared 8 at a time with the same bytes shifted by one pixel.
+	inline size_t runLength(const uint8_t pixels[], size_t count, size_t bpp) {
+		const uint8_t *end = pixels + count * bpp;
+		const uint8_t *p = pixels;
+		while (end - p >= 8) {
+			uint64_t current, before;
+			std::memcpy(&current, p, 8);
+			std::memcpy(&before, p - bpp, 8);
+			uint64_t difference = current ^ before;
+			if (difference != 0) {
+				#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+				p += __builtin_ctzll(difference) / 8;
+				#else
+				while (*p == *(p - bpp))
+					p++;
+				#endif
+				return static_cast<size_t>(p - pixels) / bpp;
+			}
+			p += 8;
+		}
+		while (p != end && *p == *(p - bpp))
+			p++;
+		return static_cast<size_t>(p - pixels) / bpp;
+	}
+
+}
+
+
+QoiOut::QoiOut(uint32_t w, uint32_t h, OutputSink &out, PixelFormat format) :
+		// Initialize most fields
+		width(w),
+		height(h),
+		pixelFormat(format),
+		output(out),
+		remaining(static_cast<uint64_t>(w) * h),
+		previous(0xFF000000),
+		run(0) {
+	if (w == 0 || h == 0)
+		throw std::domain_error("Zero width or height");
+	if (format != PixelFormat::grey && format != PixelFormat::rgb)
+		throw std::domain_error("Invalid pixel format");
+	index.fill(0);  // Never matches a pixel, as they are all opaque
+
+	const uint8_t header[] = {
+		'q', 'o', 'i', 'f',
+		static_cast<uint8_t>(w >> 24), static_cast<uint8_t>(w >> 16), static_cast<uint8_t>(w >> 8), static_cast<uint8_t>(w),
+		static_cast<uint8_t>(h >> 24), static_cast<uint8_t>(h >> 16), static_cast<uint8_t>(h >> 8), static_cast<uint8_t>(h),
+		3,  // RGB channels
+		0,  // sRGB with linear alpha
+	};
+	output.write(header, sizeof(header));
+}
+
+
+void QoiOut::write(const uint8_t pixels[], size_t count) {
+	if (count > remaining)
+		throw std::logic_error("All image pixels already written");
+	if (count > 0 && pixels == nullptr)
+		throw std::invalid_argument("Null pointer");
+	if (pixelFormat == PixelFormat::grey)
+		encode<1>(pixels, count);
+	else
+		encode<3>(pixels, count);
+}
+
+
+void QoiOut::writeRows(const uint8_t pixels[], uint32_t rows, std::ptrdiff_t stride) {
+	if (pixels == nullptr)
+		throw std::invalid_argument("Null pointer");
+	for (uint32_t i = 0; i < rows; i++)
+		write(pixels + static_cast<std::ptrdiff_t>(i) * stride, width);
+}
+
+
+template <int BytesPerPixel>
+void QoiOut::encode(const uint8_t pixels[], size_t count) {
+	// The operations are collected on the stack and passed to the sink a chunk at a time
+	uint8_t chunk[CHUNK_SIZE];
+	size_t filled = 0;
+	uint32_t prev = previous;
+	uint32_t pendingRun = run;
+
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t *p = &pixels[i * BytesPerPixel];
+		uint32_t r = p[0];
+		uint32_t g = BytesPerPixel == 3 ? p[1] : r;
+		uint32_t b = BytesPerPixel == 3 ? p[2] : r;
+		uint32_t px = r | g << 8 | b << 16 | 0xFF000000;
+
+		if (px == prev) {  // Flat areas are long runs, most pixels stop here
+			// Skip all of the run at once, comparing the following pixels with the ones before them
+			size_t length = 1 + runLength(p + BytesPerPixel, count - i - 1, BytesPerPixel);
+			i += length - 1;
+			uint64_t total = pendingRun + length;
+			for (uint64_t j = total / MAX_RUN; j > 0; j--) {
+				chunk[filled++] = static_cast<uint8_t>(OP_RUN | (MAX_RUN - 1));
+				if (filled == CHUNK_SIZE) {
+					output.write(chunk, filled);
+					filled = 0;
+				}
+			}
+			pendingRun = static_cast<uint32_t>(total % MAX_RUN);
+		} else {
+			if (pendingRun > 0) {
+				chunk[filled++] = static_cast<uint8_t>(OP_RUN | (pendingRun - 1));
+				pendingRun = 0;
+			}
+			uint32_t hash = hashPixel(r, g, b);
+			if (index[hash] == px)
+				chunk[filled++] = static_cast<uint8_t>(OP_INDEX | hash);
+			else {
+				index[hash] = px;
+				// Differences wrap around, as in 8-bit arithmetic
+				int dr = static_cast<int8_t>(r - (prev & 0xFF));
+				int dg = static_cast<int8_t>(g - (prev >> 8 & 0xFF));
+				int db = static_cast<int8_t>(b - (prev >> 16 & 0xFF));
+				int drg = dr - dg, dbg = db - dg;
+				if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+					chunk[filled++] = static_cast<uint8_t>(OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+				else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+					chunk[filled++] = static_cast<uint8_t>(OP_LUMA | (dg + 32));
+					chunk[filled++] = static_cast<uint8_t>((drg + 8) << 4 | (dbg + 8));
+				} else {
+					chunk[filled++] = OP_RGB;
+					chunk[filled++] = static_cast<uint8_t>(r);
+					chunk[filled++] = static_cast<uint8_t>(g);
+					chunk[filled++] = static_cast<uint8_t>(b);
+				}
+			}
+			prev = px;
+		}
+
+		if (filled > CHUNK_SIZE - 5) {  // Room left for the longest operation (after a run)
+			output.write(chunk, filled);
+			filled = 0;
+		}
+	}
+
+	remaining -= count;
+	if (remaining == 0 && pendingRun > 0) {  // The last run ends with the image
+		chunk[filled++] = static_cast<uint8_t>(OP_RUN | (pendingRun - 1));
+		pendingRun = 0;
+	}
+	output.write(chunk, filled);
+	if (remaining == 0) {
+		const uint8_t end[] = {0, 0, 0, 0, 0, 0, 0, 1};
+		output.write(end, sizeof(end));
+		output.flush();
+	}
+	previous = prev;
+	run = pendingRun;
+}
@@ -0,0 +1,174 @@
+/*
+ * Output sinks for Tiny PNG Output (C++)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+/*
+ * Destination of the bytes of an encoded image. Writes are collected in a large buffer, so that the
+ * many small writes of an encoder (chunk headers, filter bytes, line spans) become a few large ones.
+ */
+class OutputSink {
+
+	/*---- Constants ----*/
+
+	// The buffer is aligned to, and a multiple of, this size (enough for O_DIRECT on common file systems)
+	public: static constexpr std::size_t ALIGNMENT = 4096;
+
+	public: static constexpr std::size_t DEFAULT_BUFFER_SIZE = 1 << 20;
+
+
+
+	/*---- Fields ----*/
+
+	private: struct FreeDeleter {
+		void operator()(std::uint8_t *p) const { std::free(p); }
+	};
+
+	protected: std::unique_ptr<std::uint8_t[], FreeDeleter> buffer;
+	protected: std::size_t capacity;  // Size of 'buffer', a multiple of ALIGNMENT
+	protected: std::size_t filled;    // Bytes of 'buffer' not yet written out
+
+
+
+	/*---- Public methods ----*/
+
+	public: virtual ~OutputSink() = default;
+
+	public: OutputSink(const OutputSink &) = delete;
+	public: OutputSink &operator=(const OutputSink &) = delete;
+
+
+	/*
+	 * Appends the given bytes. They are only copied into the buffer, unless it is full.
+	 */
+	public: void write(const std::uint8_t data[], std::size_t len) {
+		if (len <= capacity - filled) {
+			std::memcpy(&buffer[filled], data, len);
+			filled += len;
+		} else
+			overflow(data, len);
+	}
+
+
+	/*
+	 * Passes the buffered bytes on to the destination.
+	 */
+	public: virtual void flush();
+
+
+
+	/*---- Methods for the implementations ----*/
+
+	// Allocates the buffer, rounding its size up to a multiple of ALIGNMENT
+	protected: explicit OutputSink(std::size_t bufferSize);
+
+
+	// Writes 'len' bytes of 'data', then 'extraLen' bytes of 'extra', to the destination.
+	protected: virtual void writeOut(const std::uint8_t data[], std::size_t len, const std::uint8_t extra[], std::size_t extraLen) = 0;
+
+
+	// Called by write() when the buffer cannot hold 'len' more bytes: writes the buffer out, together with
+	// the data if it is large, or keeps the data in the emptied buffer.
+	protected: virtual void overflow(const std::uint8_t data[], std::size_t len);
+
+};
+
+
+
+/*
+ * Writes to a std::ostream, which is left open.
+ */
+class OstreamSink final : public OutputSink {
+
+	private: std::ostream &output;
+
+
+	public: explicit OstreamSink(std::ostream &out, std::size_t bufferSize = 1 << 16);
+
+	// Flushes the buffered bytes, ignoring errors
+	public: ~OstreamSink() override;
+
+	public: void flush() override;
+
+	protected: void writeOut(const std::uint8_t data[], std::size_t len, const std::uint8_t extra[], std::size_t extraLen) override;
+
+};
+
+
+
+/*
+ * Appends to a std::vector in memory, e.g. to encode an image before storing it in a larger container.
+ */
+class VectorSink final : public OutputSink {
+
+	private: std::vector<std::uint8_t> &output;
+
+
+	public: explicit VectorSink(std::vector<std::uint8_t> &out, std::size_t bufferSize = 1 << 16);
+
+	// Flushes the buffered bytes
+	public: ~VectorSink() override;
+
+	protected: void writeOut(const std::uint8_t data[], std::size_t len, const std::uint8_t extra[], std::size_t extraLen) override;
+
+};
+
+
+
+/*
+ * Writes to a file through its raw file descriptor, with write() and writev() calls of at least the buffer size
+ * (except the last one). With 'directIo' the file is opened with O_DIRECT, bypassing the page cache: all writes are
+ * then whole aligned blocks, the last one padded and the file truncated to its real size on close(). File systems
+ * that do not support O_DIRECT get normal buffered writes.
+ * Throws std::system_error on I/O errors.
+ */
+class FdSink final : public OutputSink {
+
+	private: std::string path;
+	private: int fd;
+	private: bool direct;
+	private: std::uint64_t size;  // Bytes written to the file so far
+
+
+	// Creates (or truncates) the file at the given path
+	public: explicit FdSink(const std::string &filePath, bool directIo = false, std::size_t bufferSize = DEFAULT_BUFFER_SIZE);
+
+	// Closes the file, ignoring errors: call close() to get them
+	public: ~FdSink() override;
+
+	// With O_DIRECT only whole blocks are written, the rest is kept until more data or close()
+	public: void flush() override;
+
+	// Writes all the buffered bytes and closes the file
+	public: void close();
+
+	public: bool isDirect() const {
+		return direct;
+	}
+
+	protected: void writeOut(const std::uint8_t data[], std::size_t len, const std::uint8_t extra[], std::size_t extraLen) override;
+
+	protected: void overflow(const std::uint8_t data[], std::size_t len) override;
+
+};
@@ -23,23 +23,41 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <ostream>
+#include <stdexcept>
+#include <vector>
+#include "OutputSink.hpp"
 
 
 /*
- * Takes image pixel data in raw RGB8.8.8 format and writes a PNG file to a byte output stream.
+ * Takes image pixel data in raw RGB8.8.8, grey 8 or 8-bit palette index format and writes a PNG file to a byte output stream.
+ * The image data is either stored uncompressed (level 0) or filtered and compressed with LZ77 and fixed Huffman codes.
  */
 class TinyPngOut final {
 
+	/*---- Public types ----*/
+
+	// The PNG color types that can be written, all with 8 bits per sample
+	public: enum class ColorType : std::uint8_t {
+		grey = 0,     // 1 byte per pixel
+		rgb = 2,      // 3 bytes per pixel
+		palette = 3,  // 1 byte per pixel, an index into the palette
+	};
+
+
+
     /*---- Fields ----*/
 
 	// Immutable configuration
 	private: std::uint32_t width;   // Measured in pixels
 	private: std::uint32_t height;  // Measured in pixels
-	private: std::uint32_t lineSize;  // Measured in bytes, equal to (width * 3 + 1)
+	private: std::uint32_t bytesPerPixel;  // 3 for RGB, 1 for grey and palette indices
+	private: std::uint32_t lineSize;  // Measured in bytes, equal to (width * bytesPerPixel + 1)
 
 	// Running state
-	private: std::ostream &output;
+	private: std::unique_ptr<OutputSink> ownedOutput;  // Adapter when writing to a std::ostream
+	private: OutputSink *output;
 	private: std::uint32_t positionX;      // Next byte index in current line
 	private: std::uint32_t positionY;      // Line index of next byte
 	private: std::uint32_t uncompRemain;   // Number of uncompressed bytes remaining
@@ -47,6 +65,14 @@ class TinyPngOut final {
 	private: std::uint32_t crc;    // Primarily for IDAT chunk
 	private: std::uint32_t adler;  // For DEFLATE data within IDAT
 
+	// Compression state, null when writing stored (uncompressed) DEFLATE blocks
+	private: class Deflater;
+	private: std::unique_ptr<Deflater> deflater;
+	private: std::vector<std::uint8_t> currentLine;    // Pixels of the line being written, after bytesPerPixel zeros
+	private: std::vector<std::uint8_t> previousLine;   // Same for the line above, all zeros for the first line
+	private: std::vector<std::uint8_t> filteredLines;  // The current line with each filter type, filter byte included
+	private: std::size_t filterTypesTried;  // Number of filter types tried on each line (None is always the first)
+
 
 
 	/*---- Public constructor and method ----*/
@@ -59,10 +85,39 @@ class TinyPngOut final {
 	public: explicit TinyPngOut(std::uint32_t w, std::uint32_t h, std::ostream &out);
 
 
+	/*
+	 * Creates a PNG writer like above, compressing the image data with the given level (0 to 9).
+	 * Level 0 writes stored blocks, level 1 only looks for runs of the previous pixel and the pixel above,
+	 * levels 2 to 9 search hash chains of increasing length (with lazy matching from level 4) and pick the
+	 * row filter (None, Sub, Up or Paeth) of each line with the minimum sum of absolute differences heuristic.
+	 * The compressed image data is written in IDAT chunks of at most IDAT_CHUNK_SIZE bytes as it is produced.
+	 */
+	public: explicit TinyPngOut(std::uint32_t w, std::uint32_t h, std::ostream &out, int level);
+
+
+	/*
+	 * Creates a PNG writer like above for the given color type. The palette (only for ColorType::palette)
+	 * holds up to 256 RGB triplets; pixels are then indices into it. Throws an exception if the palette is invalid.
+	 */
+	public: explicit TinyPngOut(std::uint32_t w, std::uint32_t h, std::ostream &out, int level,
+		ColorType colorType, const std::vector<std::uint8_t> &palette = {});
+
+
+	/*
+	 * Creates a PNG writer like above that writes to the given sink, which is flushed (but not closed)
+	 * once the whole image has been written. Writing to a std::ostream goes through an OstreamSink.
+	 */
+	public: explicit TinyPngOut(std::uint32_t w, std::uint32_t h, OutputSink &out, int level = 0,
+		ColorType colorType = ColorType::rgb, const std::vector<std::uint8_t> &palette = {});
+
+
+	public: ~TinyPngOut();
+
+
 	/*
 	 * Writes 'count' pixels from the given array to the output stream. This reads count*3
-	 * bytes from the array. Pixels are presented from top to bottom, left to right, and with
-	 * subpixels in RGB order. This object keeps track of how many pixels were written and
+	 * bytes from the array (count bytes for grey and palette images). Pixels are presented from top to bottom,
+	 * left to right, and with subpixels in RGB order. This object keeps track of how many pixels were written and
 	 * various position variables. It is an error to write more pixels in total than width*height.
 	 * Once exactly width*height pixels have been written with this TinyPngOut object,
 	 * there are no more valid operations on the object and it should be discarded.
@@ -70,6 +125,44 @@ class TinyPngOut final {
 	public: void write(const std::uint8_t pixels[], size_t count);
 
 
+	/*
+	 * Writes all the remaining lines, from top to bottom, taking each of them from 'getRow(y)', which must return
+	 * a pointer to the 'width' pixels of line y. The pointer only needs to stay valid until the next call, so rows
+	 * can come from any layout (e.g. bottom-up as returned by OpenGL) without copying the image.
+	 * Must be called at the beginning of a line.
+	 */
+	public: template <typename RowSource>
+	void writeRows(RowSource getRow) {
+		if (positionX != 0)
+			throw std::logic_error("Not at the beginning of a line");
+		for (std::uint32_t y = positionY; y < height; y++)
+			write(getRow(y), width);
+	}
+
+
+	/*
+	 * Writes 'rows' lines starting with the one at 'pixels', each following line being 'stride' bytes after the
+	 * previous one. A negative stride reads lines bottom-up.
+	 */
+	public: void writeRows(const std::uint8_t pixels[], std::uint32_t rows, std::ptrdiff_t stride);
+
+
+	/*
+	 * Returns the CRC-32 (as used by PNG and zlib) of the given data, continuing from the given CRC of
+	 * the previous data (0 when starting). Uses slice-by-8 tables, or the CRC instructions of the CPU
+	 * (PCLMULQDQ on x86-64, CRC32 on ARMv8) when they are available at runtime.
+	 */
+	public: static std::uint32_t updateCrc32(std::uint32_t crc, const std::uint8_t data[], size_t len);
+
+
+	/*
+	 * Returns the Adler-32 (as used by zlib) of the given data, continuing from the given checksum of
+	 * the previous data (1 when starting). The modulo is only taken every 5552 bytes, and the weighted
+	 * sums are computed with SSSE3/AVX2 or NEON when the CPU supports them.
+	 */
+	public: static std::uint32_t updateAdler32(std::uint32_t adler, const std::uint8_t data[], size_t len);
+
+
 
 	/*---- Private checksum methods ----*/
 
@@ -82,18 +175,41 @@ class TinyPngOut final {
 
 
 
+	/*---- Private compression methods ----*/
+
+	// Counterpart of write() when compressing: collects the pixels of each line to filter it.
+	private: void writeCompressed(const std::uint8_t pixels[], size_t count);
+
+
+	// Filters the complete current line with the filter type that minimizes the sum of absolute differences,
+	// then compresses it.
+	private: void writeFilteredLine();
+
+
+	// Writes the compressed bytes produced so far as an IDAT chunk (nothing if there are none).
+	private: void writeIdatChunk();
+
+
+
 	/*---- Private utility members ----*/
 
 	private: template <std::size_t N>
 	void write(const std::uint8_t (&data)[N]) {
-		output.write(reinterpret_cast<const char*>(data), sizeof(data));
+		output->write(data, N);
 	}
 
 
+	// The constructor of all the public ones, 'out' being 'owned' if it is not null
+	private: explicit TinyPngOut(std::uint32_t w, std::uint32_t h, std::unique_ptr<OutputSink> owned, OutputSink *out,
+		int level, ColorType colorType, const std::vector<std::uint8_t> &palette);
+
+
 	private: static void putBigUint32(std::uint32_t val, std::uint8_t array[4]);
 
 
 	private: static constexpr std::uint16_t DEFLATE_MAX_BLOCK_SIZE = 65535;
 
+	private: static constexpr std::size_t IDAT_CHUNK_SIZE = 1 << 18;
+
 };
 
@@ -0,0 +1,230 @@
+/*
+ * Output sinks for Tiny PNG Output (C++)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "OutputSink.hpp"
+
+using std::uint8_t;
+using std::uint64_t;
+using std::size_t;
+
+
+/*---- OutputSink ----*/
+
+OutputSink::OutputSink(size_t bufferSize) :
+		capacity((std::max(bufferSize, static_cast<size_t>(1)) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT),
+		filled(0) {
+	buffer.reset(static_cast<uint8_t*>(std::aligned_alloc(ALIGNMENT, capacity)));
+	if (!buffer)
+		throw std::bad_alloc();
+}
+
+
+void OutputSink::flush() {
+	if (filled > 0)
+		writeOut(buffer.get(), filled, nullptr, 0);
+	filled = 0;
+}
+
+
+void OutputSink::overflow(const uint8_t data[], size_t len) {
+	if (len >= capacity) {  // Copying would not save any call
+		writeOut(buffer.get(), filled, data, len);
+		filled = 0;
+	} else {
+		flush();
+		std::memcpy(buffer.get(), data, len);
+		filled = len;
+	}
+}
+
+
+
+/*---- OstreamSink ----*/
+
+OstreamSink::OstreamSink(std::ostream &out, size_t bufferSize) :
+	OutputSink(bufferSize),
+	output(out) {}
+
+
+OstreamSink::~OstreamSink() {
+	try {
+		OutputSink::flush();
+	} catch (...) {}
+}
+
+
+void OstreamSink::flush() {
+	OutputSink::flush();
+	output.flush();
+}
+
+
+void OstreamSink::writeOut(const uint8_t data[], size_t len, const uint8_t extra[], size_t extraLen) {
+	output.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(len));
+	if (extraLen > 0)
+		output.write(reinterpret_cast<const char*>(extra), static_cast<std::streamsize>(extraLen));
+}
+
+
+
+/*---- VectorSink ----*/
+
+VectorSink::VectorSink(std::vector<uint8_t> &out, size_t bufferSize) :
+	OutputSink(bufferSize),
+	output(out) {}
+
+
+VectorSink::~VectorSink() {
+	try {
+		OutputSink::flush();
+	} catch (...) {}  // Only std::bad_alloc
+}
+
+
+void VectorSink::writeOut(const uint8_t data[], size_t len, const uint8_t extra[], size_t extraLen) {
+	output.insert(output.end(), data, data + len);
+	output.insert(output.end(), extra, extra + extraLen);
+}
+
+
+
+/*---- FdSink ----*/
+
+FdSink::FdSink(const std::string &filePath, bool directIo, size_t bufferSize) :
+		OutputSink(bufferSize),
+		path(filePath),
+		fd(-1),
+		direct(false),
+		size(0) {
+	const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	#ifdef O_DIRECT
+	if (directIo) {
+		fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+		direct = fd != -1;
+		// EINVAL: the file system does not support O_DIRECT, write through the page cache instead
+		if (fd == -1 && errno != EINVAL)
+			throw std::system_error(errno, std::generic_category(), "Opening " + path);
+	}
+	#endif
+	if (fd == -1)
+		fd = ::open(path.c_str(), flags, 0644);
+	if (fd == -1)
+		throw std::system_error(errno, std::generic_category(), "Opening " + path);
+}
+
+
+FdSink::~FdSink() {
+	if (fd != -1) {
+		try {
+			close();
+		} catch (...) {}
+	}
+}
+
+
+void FdSink::flush() {
+	if (!direct) {
+		OutputSink::flush();
+		return;
+	}
+	size_t blocks = filled / ALIGNMENT * ALIGNMENT;
+	if (blocks > 0) {
+		writeOut(buffer.get(), blocks, nullptr, 0);
+		std::memmove(buffer.get(), &buffer[blocks], filled - blocks);
+		filled -= blocks;
+	}
+}
+
+
+void FdSink::close() {
+	if (fd == -1)
+		return;
+	uint64_t fileSize = size + filled;
+	if (direct && filled % ALIGNMENT != 0) {
+		// O_DIRECT can only write whole blocks: pad the last one with zeros, then cut the file to its size
+		size_t padded = (filled + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+		std::memset(&buffer[filled], 0, padded - filled);
+		writeOut(buffer.get(), padded, nullptr, 0);
+		filled = 0;
+		if (::ftruncate(fd, static_cast<off_t>(fileSize)) != 0)
+			throw std::system_error(errno, std::generic_category(), "Truncating " + path);
+	} else
+		OutputSink::flush();
+	size = fileSize;
+
+	int result = ::close(fd);
+	fd = -1;
+	if (result != 0)
+		throw std::system_error(errno, std::generic_category(), "Closing " + path);
+}
+
+
+void FdSink::writeOut(const uint8_t data[], size_t len, const uint8_t extra[], size_t extraLen) {
+	if (fd == -1)
+		throw std::logic_error("File already closed");
+	iovec pieces[] = {
+		{const_cast<uint8_t*>(data), len},
+		{const_cast<uint8_t*>(extra), extraLen},
+	};
+	iovec *next = pieces;
+	int remaining = extraLen > 0 ? 2 : 1;
+	size += len + extraLen;
+	while (remaining > 0) {
+		ssize_t written = ::writev(fd, next, remaining);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::system_error(errno, std::generic_category(), "Writing " + path);
+		}
+		// Skip what was written, the kernel may stop in the middle of a piece
+		size_t n = static_cast<size_t>(written);
+		while (remaining > 0 && n >= next->iov_len) {
+			n -= next->iov_len;
+			next++;
+			remaining--;
+		}
+		if (remaining > 0) {
+			next->iov_base = static_cast<uint8_t*>(next->iov_base) + n;
+			next->iov_len -= n;
+		}
+	}
+}
+
+
+void FdSink::overflow(const uint8_t data[], size_t len) {
+	if (!direct) {
+		OutputSink::overflow(data, len);
+		return;
+	}
+	// Unaligned user data cannot be written with O_DIRECT: everything goes through the buffer, one full buffer at a time
+	while (len > 0) {
+		size_t n = std::min(len, capacity - filled);
+		std::memcpy(&buffer[filled], data, n);
+		filled += n;
+		data += n;
+		len -= n;
+		if (filled == capacity) {
+			writeOut(buffer.get(), capacity, nullptr, 0);
+			filled = 0;
+		}
+	}
+}
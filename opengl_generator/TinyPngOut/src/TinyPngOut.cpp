@@ -20,11 +20,32 @@
  */
 
 #include <algorithm>
+#include <cstdlib>
+#include <array>
+#include <cstring>
+#include <iterator>
 #include <cassert>
 #include <limits>
 #include <stdexcept>
 #include "TinyPngOut.hpp"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define TINYPNGOUT_CRC32_PCLMUL
+#define TINYPNGOUT_ADLER32_X86
+#define TINYPNGOUT_FILTER_SSE2
+#elif defined(__aarch64__) && defined(__GNUC__)
+#include <arm_neon.h>
+#define TINYPNGOUT_ADLER32_NEON
+#define TINYPNGOUT_FILTER_NEON
+#if defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define TINYPNGOUT_CRC32_ARMV8
+#endif
+#endif
+
 using std::uint8_t;
 using std::uint16_t;
 using std::uint32_t;
@@ -32,22 +53,569 @@ using std::uint64_t;
 using std::size_t;
 
 
+/*---- PNG row filters ----*/
+
+// Each kernel filters a row and returns the sum of the absolute values of the filtered bytes seen as signed,
+// the usual heuristic to pick the filter that compresses best. 'row' and 'prior' must be preceded by
+// 'bpp' zero bytes, so that the pixels left of the first one read as zero.
+// SSE2 and NEON are part of the base x86-64 and AArch64 instruction sets, so no runtime dispatch is needed.
+namespace {
+
+	enum FilterType : uint8_t {
+		FILTER_NONE = 0,
+		FILTER_SUB = 1,
+		FILTER_UP = 2,
+		FILTER_PAETH = 4,
+	};
+
+	const FilterType FILTER_TYPES[] = {FILTER_NONE, FILTER_SUB, FILTER_UP, FILTER_PAETH};
+
+
+	inline uint8_t paethPredictor(int a, int b, int c) {
+		int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+		return static_cast<uint8_t>(pa <= pb && pa <= pc ? a : (pb <= pc ? b : c));
+	}
+
+
+	template <FilterType T>
+	inline uint8_t predict(const uint8_t row[], const uint8_t prior[], ptrdiff_t i, size_t bpp) {
+		if (T == FILTER_SUB)
+			return row[i - static_cast<ptrdiff_t>(bpp)];
+		if (T == FILTER_UP)
+			return prior[i];
+		if (T == FILTER_PAETH)
+			return paethPredictor(row[i - static_cast<ptrdiff_t>(bpp)], prior[i], prior[i - static_cast<ptrdiff_t>(bpp)]);
+		return 0;
+	}
+
+
+	template <FilterType T>
+	uint32_t filterRowScalar(const uint8_t row[], const uint8_t prior[], uint8_t out[], size_t begin, size_t len, size_t bpp) {
+		uint32_t cost = 0;
+		for (size_t i = begin; i < len; i++) {
+			uint8_t v = static_cast<uint8_t>(row[i] - predict<T>(row, prior, static_cast<ptrdiff_t>(i), bpp));
+			out[i] = v;
+			cost += v < 128 ? v : 256 - v;
+		}
+		return cost;
+	}
+
+
+	#if defined(TINYPNGOUT_FILTER_SSE2)
+	inline __m128i abs16(__m128i x) {
+		return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+	}
+
+	inline __m128i select128(__m128i mask, __m128i ifSet, __m128i ifClear) {
+		return _mm_or_si128(_mm_and_si128(mask, ifSet), _mm_andnot_si128(mask, ifClear));
+	}
+
+	// Paeth predictor of 8 pixels bytes widened to 16 bits
+	inline __m128i paethPredictor16(__m128i a, __m128i b, __m128i c) {
+		__m128i bc = _mm_sub_epi16(b, c), ac = _mm_sub_epi16(a, c);
+		__m128i pa = abs16(bc), pb = abs16(ac), pc = abs16(_mm_add_epi16(bc, ac));
+		__m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+		__m128i notB = _mm_cmpgt_epi16(pb, pc);
+		return select128(notA, select128(notB, c, b), a);
+	}
+
+	template <FilterType T>
+	uint32_t filterRow(const uint8_t row[], const uint8_t prior[], uint8_t out[], size_t len, size_t bpp) {
+		const __m128i zero = _mm_setzero_si128();
+		__m128i cost = zero;
+		size_t i = 0;
+		for (; i + 16 <= len; i += 16) {
+			__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i - bpp));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i));
+			__m128i predicted = zero;
+			if (T == FILTER_SUB)
+				predicted = a;
+			else if (T == FILTER_UP)
+				predicted = b;
+			else if (T == FILTER_PAETH) {
+				__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i - bpp));
+				__m128i low = paethPredictor16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+				__m128i high = paethPredictor16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+				predicted = _mm_packus_epi16(low, high);
+			}
+			__m128i v = _mm_sub_epi8(x, predicted);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), v);
+			cost = _mm_add_epi64(cost, _mm_sad_epu8(_mm_min_epu8(v, _mm_sub_epi8(zero, v)), zero));
+		}
+		cost = _mm_add_epi64(cost, _mm_unpackhi_epi64(cost, cost));
+		return static_cast<uint32_t>(_mm_cvtsi128_si32(cost)) + filterRowScalar<T>(row, prior, out, i, len, bpp);
+	}
+
+	#elif defined(TINYPNGOUT_FILTER_NEON)
+	inline uint8x8_t paethPredictor8(uint8x8_t a, uint8x8_t b, uint8x8_t c) {
+		int16x8_t bc = vreinterpretq_s16_u16(vsubl_u8(b, c)), ac = vreinterpretq_s16_u16(vsubl_u8(a, c));
+		int16x8_t pa = vabsq_s16(bc), pb = vabsq_s16(ac), pc = vabsq_s16(vaddq_s16(bc, ac));
+		uint8x8_t notA = vmovn_u16(vorrq_u16(vcgtq_s16(pa, pb), vcgtq_s16(pa, pc)));
+		uint8x8_t notB = vmovn_u16(vcgtq_s16(pb, pc));
+		return vbsl_u8(notA, vbsl_u8(notB, c, b), a);
+	}
+
+	template <FilterType T>
+	uint32_t filterRow(const uint8_t row[], const uint8_t prior[], uint8_t out[], size_t len, size_t bpp) {
+		uint32x4_t cost = vdupq_n_u32(0);
+		size_t i = 0;
+		for (; i + 16 <= len; i += 16) {
+			uint8x16_t x = vld1q_u8(row + i);
+			uint8x16_t a = vld1q_u8(row + i - bpp);
+			uint8x16_t b = vld1q_u8(prior + i);
+			uint8x16_t predicted = vdupq_n_u8(0);
+			if (T == FILTER_SUB)
+				predicted = a;
+			else if (T == FILTER_UP)
+				predicted = b;
+			else if (T == FILTER_PAETH) {
+				uint8x16_t c = vld1q_u8(prior + i - bpp);
+				predicted = vcombine_u8(paethPredictor8(vget_low_u8(a), vget_low_u8(b), vget_low_u8(c)),
+					paethPredictor8(vget_high_u8(a), vget_high_u8(b), vget_high_u8(c)));
+			}
+			uint8x16_t v = vsubq_u8(x, predicted);
+			vst1q_u8(out + i, v);
+			// vabsq_s8 wraps -128 to 0x80, which is 128 as unsigned
+			cost = vpadalq_u16(cost, vpaddlq_u8(vreinterpretq_u8_s8(vabsq_s8(vreinterpretq_s8_u8(v)))));
+		}
+		return vaddvq_u32(cost) + filterRowScalar<T>(row, prior, out, i, len, bpp);
+	}
+
+	#else
+	template <FilterType T>
+	uint32_t filterRow(const uint8_t row[], const uint8_t prior[], uint8_t out[], size_t len, size_t bpp) {
+		return filterRowScalar<T>(row, prior, out, 0, len, bpp);
+	}
+	#endif
+
+
+	uint32_t filterRow(FilterType type, const uint8_t row[], const uint8_t prior[], uint8_t out[], size_t len, size_t bpp) {
+		switch (type) {
+			case FILTER_SUB:    return filterRow<FILTER_SUB>(row, prior, out, len, bpp);
+			case FILTER_UP:     return filterRow<FILTER_UP>(row, prior, out, len, bpp);
+			case FILTER_PAETH:  return filterRow<FILTER_PAETH>(row, prior, out, len, bpp);
+			default:            return filterRow<FILTER_NONE>(row, prior, out, len, bpp);
+		}
+	}
+
+}
+
+
+
+/*---- DEFLATE compressor ----*/
+
+namespace {
+
+	constexpr size_t WINDOW_SIZE = 32768;  // Largest distance of a DEFLATE match
+	constexpr size_t MIN_MATCH = 3;
+	constexpr size_t MAX_MATCH = 258;
+	constexpr size_t LOOKAHEAD = MAX_MATCH + MIN_MATCH + 1;  // Input needed before a position can be encoded
+	constexpr int HASH_BITS = 15;
+	constexpr int32_t NO_POSITION = -1;
+
+
+	// Match search effort for each level, in the spirit of zlib's configuration_table
+	struct LevelConfig {
+		uint16_t maxChain;    // Hash chain entries tried per position
+		uint16_t niceLength;  // Stop searching once a match this long is found
+		uint16_t maxLazy;     // Look for a better match at the next position only below this length (0 = greedy)
+		uint16_t maxInsert;   // Greedy levels only add the positions inside matches up to this length to the hash chains
+	};
+
+	const LevelConfig LEVEL_CONFIGS[10] = {
+		{   0,   0,   0,   0},  // 0: stored blocks, never used by the deflater
+		{   0, 258,   0,   0},  // 1: previous pixel and pixel above only
+		{   4,  16,   0,   4},
+		{   8,  32,   0,   6},
+		{   4,  16,   4, 258},
+		{  16,  32,  16, 258},
+		{  32, 128,  32, 258},
+		{  64, 128,  64, 258},
+		{ 256, 258, 128, 258},
+		{1024, 258, 258, 258},
+	};
+
+
+	const uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+	const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+	const uint16_t DISTANCE_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+	const uint8_t DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+
+	// The fixed Huffman codes of RFC 1951 section 3.2.6, bit-reversed so that they can be written LSB first,
+	// and the symbol lookups for match lengths and distances
+	struct FixedCodes {
+		std::array<uint16_t, 288> literalCode;
+		std::array<uint8_t, 288> literalLength;
+		std::array<uint8_t, 30> distanceCode;
+		std::array<uint8_t, MAX_MATCH + 1> lengthSymbol;  // Index of LENGTH_BASE for each match length
+		std::array<uint8_t, 512> distanceSymbol;  // By distance-1 below 256, then by (distance-1)>>7
+
+		static uint16_t reverse(uint16_t code, int length) {
+			uint16_t result = 0;
+			for (int i = 0; i < length; i++, code >>= 1)
+				result = static_cast<uint16_t>(result << 1 | (code & 1));
+			return result;
+		}
+
+		FixedCodes() {
+			for (int i = 0; i < 288; i++) {
+				int length, code;
+				if (i < 144)      { length = 8; code = 0x30 + i; }
+				else if (i < 256) { length = 9; code = 0x190 + i - 144; }
+				else if (i < 280) { length = 7; code = i - 256; }
+				else              { length = 8; code = 0xC0 + i - 280; }
+				literalCode[i] = reverse(static_cast<uint16_t>(code), length);
+				literalLength[i] = static_cast<uint8_t>(length);
+			}
+			for (int i = 0; i < 30; i++)
+				distanceCode[i] = static_cast<uint8_t>(reverse(static_cast<uint16_t>(i), 5));
+			for (uint8_t sym = 0; sym < 29; sym++) {
+				for (int len = LENGTH_BASE[sym]; len < LENGTH_BASE[sym] + (1 << LENGTH_EXTRA[sym]) && len <= static_cast<int>(MAX_MATCH); len++)
+					lengthSymbol[len] = sym;
+			}
+			for (uint8_t sym = 0; sym < 30; sym++) {
+				for (int d = DISTANCE_BASE[sym] - 1; d < DISTANCE_BASE[sym] - 1 + (1 << DISTANCE_EXTRA[sym]); d++)
+					distanceSymbol[d < 256 ? d : 256 + (d >> 7)] = sym;
+			}
+		}
+	};
+
+	const FixedCodes &fixedCodes() {
+		static const FixedCodes codes;
+		return codes;
+	}
+
+}
+
+
+/*
+ * Compresses its input into a single final DEFLATE block with fixed Huffman codes. The input is kept
+ * in a buffer of two windows: once it is full, the upper window is slid down and the hash positions
+ * are rebased, as in zlib.
+ */
+class TinyPngOut::Deflater final {
+
+	private: const LevelConfig config;
+	private: const int level;
+	private: const size_t pixelDistance;  // Bytes per pixel
+	private: const size_t lineDistance;   // Bytes per line, filter byte included
+
+	private: std::vector<uint8_t> window;
+	private: size_t windowEnd;  // Number of valid bytes in 'window'
+	private: size_t position;   // Next byte of 'window' to encode
+	private: std::vector<int32_t> head;  // Most recent position of each hash value
+	private: std::vector<int32_t> prev;  // Previous position with the same hash, by position modulo WINDOW_SIZE
+
+	// Lazy matching state: the match found at position-1, not yet emitted
+	private: bool havePrevious;
+	private: size_t previousLength;
+	private: size_t previousDistance;
+
+	private: uint64_t bitBuffer;
+	private: int bitCount;
+	private: std::vector<uint8_t> output;
+
+
+	public: Deflater(int lvl, size_t bytesPerPixel, size_t lineSize) :
+			config(LEVEL_CONFIGS[lvl]),
+			level(lvl),
+			pixelDistance(bytesPerPixel),
+			lineDistance(lineSize),
+			window(2 * WINDOW_SIZE),
+			windowEnd(0),
+			position(0),
+			havePrevious(false),
+			previousLength(0),
+			previousDistance(0),
+			bitBuffer(0),
+			bitCount(0) {
+		if (level > 1) {
+			head.assign(static_cast<size_t>(1) << HASH_BITS, NO_POSITION);
+			prev.assign(WINDOW_SIZE, NO_POSITION);
+		}
+		putBits(1, 1);  // BFINAL
+		putBits(1, 2);  // BTYPE = fixed Huffman codes
+	}
+
+
+	// Compressed bytes produced so far, to be consumed (and cleared) by the caller
+	public: std::vector<uint8_t> &getOutput() {
+		return output;
+	}
+
+
+	public: void write(const uint8_t data[], size_t len) {
+		while (len > 0) {
+			if (windowEnd == window.size())
+				slide();
+			size_t n = std::min(len, window.size() - windowEnd);
+			std::memcpy(&window[windowEnd], data, n);
+			windowEnd += n;
+			data += n;
+			len -= n;
+			compress(false);
+		}
+	}
+
+
+	// Compresses the remaining input, ends the block and pads the output to a whole byte
+	public: void finish() {
+		compress(true);
+		putLiteral(256);
+		if (bitCount > 0)
+			putBits(0, (8 - bitCount % 8) % 8);
+		while (bitCount > 0) {
+			output.push_back(static_cast<uint8_t>(bitBuffer));
+			bitBuffer >>= 8;
+			bitCount -= 8;
+		}
+	}
+
+
+	private: void slide() {
+		std::memmove(&window[0], &window[WINDOW_SIZE], windowEnd - WINDOW_SIZE);
+		windowEnd -= WINDOW_SIZE;
+		position -= WINDOW_SIZE;
+		auto rebase = [](int32_t &p) {
+			p = p >= static_cast<int32_t>(WINDOW_SIZE) ? p - static_cast<int32_t>(WINDOW_SIZE) : NO_POSITION;
+		};
+		std::for_each(head.begin(), head.end(), rebase);
+		std::for_each(prev.begin(), prev.end(), rebase);
+	}
+
+
+	// Encodes the positions that have enough lookahead (all of them when 'flush' is set)
+	private: void compress(bool flush) {
+		size_t limit = flush ? windowEnd : (windowEnd >= LOOKAHEAD ? windowEnd - LOOKAHEAD : 0);
+		if (level == 1)
+			compressPixelRuns(limit);
+		else if (config.maxLazy == 0)
+			compressGreedy(limit);
+		else
+			compressLazy(limit, flush);
+	}
+
+
+	private: void compressPixelRuns(size_t limit) {
+		while (position < limit) {
+			size_t distance = 0;
+			size_t length = pixelMatch(MIN_MATCH - 1, distance);
+			if (length >= MIN_MATCH) {
+				putMatch(length, distance);
+				position += length;
+			} else {
+				putLiteral(window[position]);
+				position++;
+			}
+		}
+	}
+
+
+	private: void compressGreedy(size_t limit) {
+		while (position < limit) {
+			size_t distance = 0;
+			size_t length = pixelMatch(MIN_MATCH - 1, distance);
+			length = longestMatch(insertHash(position), length, distance);
+			if (length >= MIN_MATCH) {
+				putMatch(length, distance);
+				if (length <= config.maxInsert) {
+					for (size_t i = 1; i < length; i++)
+						insertHash(position + i);
+				}
+				position += length;
+			} else {
+				putLiteral(window[position]);
+				position++;
+			}
+		}
+	}
+
+
+	// Like zlib's deflate_slow(): a match is only emitted if the next position does not have a longer one
+	private: void compressLazy(size_t limit, bool flush) {
+		while (position < limit) {
+			int32_t candidate = insertHash(position);
+			size_t distance = 0, length = 0;
+			if (!havePrevious || previousLength < config.maxLazy) {
+				length = pixelMatch(havePrevious ? previousLength : MIN_MATCH - 1, distance);
+				length = longestMatch(candidate, length, distance);
+			}
+
+			if (havePrevious && previousLength >= MIN_MATCH && previousLength >= length) {
+				// The match that started at position-1 wins: position is already inside it
+				putMatch(previousLength, previousDistance);
+				size_t end = position - 1 + previousLength;
+				for (size_t p = position + 1; p < end; p++)
+					insertHash(p);
+				position = end;
+				havePrevious = false;
+			} else {
+				if (havePrevious)
+					putLiteral(window[position - 1]);
+				havePrevious = true;
+				previousLength = length;
+				previousDistance = distance;
+				position++;
+			}
+		}
+		if (flush && havePrevious) {
+			putLiteral(window[position - 1]);
+			havePrevious = false;
+		}
+	}
+
+
+	// Tries the previous pixel and the pixel above, the usual matches in image data that hash chains miss
+	// when they are filled with more recent positions; returns a length > bestLength, or bestLength
+	private: size_t pixelMatch(size_t bestLength, size_t &distance) const {
+		for (size_t d : {pixelDistance, lineDistance}) {
+			if (d <= position && d <= WINDOW_SIZE) {
+				size_t len = matchLength(position - d, position);
+				if (len > bestLength) {
+					bestLength = len;
+					distance = d;
+				}
+			}
+		}
+		return bestLength;
+	}
+
+
+	// Adds 'pos' to its hash chain and returns the previous head of the chain
+	private: int32_t insertHash(size_t pos) {
+		if (pos + MIN_MATCH > windowEnd)
+			return NO_POSITION;
+		uint32_t h = (static_cast<uint32_t>(window[pos]) << 10 ^ static_cast<uint32_t>(window[pos + 1]) << 5
+			^ window[pos + 2]) * 0x9E3779B1u >> (32 - HASH_BITS);
+		int32_t previous = head[h];
+		prev[pos % WINDOW_SIZE] = previous;
+		head[h] = static_cast<int32_t>(pos);
+		return previous;
+	}
+
+
+	// Follows the hash chain from 'candidate' and returns the longest match longer than 'bestLength' (or bestLength)
+	private: size_t longestMatch(int32_t candidate, size_t bestLength, size_t &distance) const {
+		int32_t oldest = static_cast<int32_t>(position) - static_cast<int32_t>(WINDOW_SIZE);
+		size_t maxLength = std::min(MAX_MATCH, windowEnd - position);
+		if (maxLength < MIN_MATCH || bestLength >= maxLength)
+			return bestLength;
+		for (int chain = config.maxChain; candidate != NO_POSITION && candidate > oldest && chain > 0; chain--) {
+			size_t c = static_cast<size_t>(candidate);
+			if (window[c + bestLength] == window[position + bestLength]) {
+				size_t len = matchLength(c, position);
+				if (len > bestLength) {
+					bestLength = len;
+					distance = position - c;
+					if (len >= config.niceLength)
+						break;
+				}
+			}
+			int32_t next = prev[c % WINDOW_SIZE];
+			if (next >= candidate)
+				break;
+			candidate = next;
+		}
+		return bestLength;
+	}
+
+
+	// Number of equal bytes at 'from' and 'pos', up to MAX_MATCH and the end of the input
+	private: size_t matchLength(size_t from, size_t pos) const {
+		size_t maxLength = std::min(MAX_MATCH, windowEnd - pos);
+		size_t len = 0;
+		for (; len + 8 <= maxLength; len += 8) {
+			uint64_t a, b;
+			std::memcpy(&a, &window[from + len], 8);
+			std::memcpy(&b, &window[pos + len], 8);
+			if (a != b)
+				return len + static_cast<size_t>(__builtin_ctzll(a ^ b) / 8);
+		}
+		while (len < maxLength && window[from + len] == window[pos + len])
+			len++;
+		return len;
+	}
+
+
+	private: void putBits(uint32_t value, int count) {
+		bitBuffer |= static_cast<uint64_t>(value) << bitCount;
+		bitCount += count;
+		if (bitCount >= 32) {
+			for (int i = 0; i < 4; i++)
+				output.push_back(static_cast<uint8_t>(bitBuffer >> (i * 8)));
+			bitBuffer >>= 32;
+			bitCount -= 32;
+		}
+	}
+
+
+	private: void putLiteral(int symbol) {
+		const FixedCodes &codes = fixedCodes();
+		putBits(codes.literalCode[symbol], codes.literalLength[symbol]);
+	}
+
+
+	private: void putMatch(size_t length, size_t distance) {
+		const FixedCodes &codes = fixedCodes();
+		uint8_t lengthSymbol = codes.lengthSymbol[length];
+		putLiteral(257 + lengthSymbol);
+		putBits(static_cast<uint32_t>(length - LENGTH_BASE[lengthSymbol]), LENGTH_EXTRA[lengthSymbol]);
+		size_t d = distance - 1;
+		uint8_t distanceSymbol = codes.distanceSymbol[d < 256 ? d : 256 + (d >> 7)];
+		putBits(codes.distanceCode[distanceSymbol], 5);
+		putBits(static_cast<uint32_t>(distance - DISTANCE_BASE[distanceSymbol]), DISTANCE_EXTRA[distanceSymbol]);
+	}
+
+};
+
+
+
 TinyPngOut::TinyPngOut(uint32_t w, uint32_t h, std::ostream &out) :
+	TinyPngOut(w, h, out, 0) {}
+
+
+TinyPngOut::TinyPngOut(uint32_t w, uint32_t h, std::ostream &out, int level) :
+	TinyPngOut(w, h, out, level, ColorType::rgb) {}
+
+
+TinyPngOut::TinyPngOut(uint32_t w, uint32_t h, std::ostream &out, int level, ColorType colorType, const std::vector<uint8_t> &palette) :
+	TinyPngOut(w, h, std::unique_ptr<OutputSink>(new OstreamSink(out)), nullptr, level, colorType, palette) {}
+
+
+TinyPngOut::TinyPngOut(uint32_t w, uint32_t h, OutputSink &out, int level, ColorType colorType, const std::vector<uint8_t> &palette) :
+	TinyPngOut(w, h, nullptr, &out, level, colorType, palette) {}
+
+
+TinyPngOut::TinyPngOut(uint32_t w, uint32_t h, std::unique_ptr<OutputSink> owned, OutputSink *out,
+		int level, ColorType colorType, const std::vector<uint8_t> &palette) :
 		// Set most of the fields
 		width(w),
 		height(h),
-		output(out),
+		bytesPerPixel(colorType == ColorType::rgb ? 3 : 1),
+		ownedOutput(std::move(owned)),
+		output(ownedOutput ? ownedOutput.get() : out),
 		positionX(0),
 		positionY(0),
 		deflateFilled(0),
-		adler(1) {
+		adler(1),
+		filterTypesTried(0) {
 
 	// Check arguments
 	if (width == 0 || height == 0)
 		throw std::domain_error("Zero width or height");
+	if (level < 0 || level > 9)
+		throw std::domain_error("Invalid compression level");
+	if (colorType == ColorType::palette ? palette.empty() || palette.size() > 3 * 256 || palette.size() % 3 != 0 : !palette.empty())
+		throw std::domain_error("Invalid palette");
 
 	// Compute and check data siezs
-	uint64_t lineSz = static_cast<uint64_t>(width) * 3 + 1;
+	uint64_t lineSz = static_cast<uint64_t>(width) * bytesPerPixel + 1;
 	if (lineSz > UINT32_MAX)
 		throw std::length_error("Image too large");
 	lineSize = static_cast<uint32_t>(lineSz);
@@ -63,7 +631,7 @@ TinyPngOut::TinyPngOut(uint32_t w, uint32_t h, std::ostream &out) :
 	// 5 bytes per DEFLATE uncompressed block header, 2 bytes for zlib header, 4 bytes for zlib Adler-32 footer
 	uint64_t idatSize = static_cast<uint64_t>(numBlocks) * 5 + 6;
 	idatSize += uncompRemain;
-	if (idatSize > static_cast<uint32_t>(INT32_MAX))
+	if (level == 0 && idatSize > static_cast<uint32_t>(INT32_MAX))
 		throw std::length_error("Image too large");
 
 	// Write header (not a pure header, but a couple of things concatenated together)
@@ -75,7 +643,7 @@ TinyPngOut::TinyPngOut(uint32_t w, uint32_t h, std::ostream &out) :
 		0x49, 0x48, 0x44, 0x52,
 		0, 0, 0, 0,  // 'width' placeholder
 		0, 0, 0, 0,  // 'height' placeholder
-		0x08, 0x02, 0x00, 0x00, 0x00,
+		0x08, 0, 0x00, 0x00, 0x00,  // Bit depth 8, 'colorType' placeholder
 		0, 0, 0, 0,  // IHDR CRC-32 placeholder
 		// IDAT chunk
 		0, 0, 0, 0,  // 'idatSize' placeholder
@@ -85,21 +653,61 @@ TinyPngOut::TinyPngOut(uint32_t w, uint32_t h, std::ostream &out) :
 	};
 	putBigUint32(width, &header[16]);
 	putBigUint32(height, &header[20]);
+	header[25] = static_cast<uint8_t>(colorType);
 	putBigUint32(idatSize, &header[33]);
 	crc = 0;
 	crc32(&header[12], 17);
 	putBigUint32(crc, &header[29]);
-	write(header);
+
+	output->write(header, 33);  // PNG header and IHDR
+	if (colorType == ColorType::palette) {
+		uint8_t plteHeader[] = {
+			0, 0, 0, 0,  // Length placeholder
+			0x50, 0x4C, 0x54, 0x45,
+		};
+		putBigUint32(static_cast<uint32_t>(palette.size()), &plteHeader[0]);
+		crc = 0;
+		crc32(&plteHeader[4], 4);
+		crc32(palette.data(), palette.size());
+		uint8_t plteFooter[4];
+		putBigUint32(crc, plteFooter);
+		write(plteHeader);
+		output->write(palette.data(), palette.size());
+		write(plteFooter);
+	}
+
+	if (level > 0) {
+		// The compressed size is unknown, so IDAT chunks come as data is compressed
+		deflater.reset(new Deflater(level, bytesPerPixel, lineSize));
+		currentLine.assign(bytesPerPixel + lineSize - 1, 0);
+		previousLine.assign(bytesPerPixel + lineSize - 1, 0);
+		// Level 1 already matches the previous pixel and the pixel above, filtering barely pays off for its speed.
+		// Filters make no sense on palette indices.
+		filterTypesTried = level == 1 || colorType == ColorType::palette ? 1 : std::size(FILTER_TYPES);
+		filteredLines.resize(filterTypesTried * lineSize);
+		// zlib header: 32 KiB window, FLEVEL from fastest to maximum compression
+		const uint8_t zlibFlags[] = {0x01, 0x01, 0x5E, 0x5E, 0x5E, 0x5E, 0x9C, 0x9C, 0xDA, 0xDA};
+		deflater->getOutput() = {0x78, zlibFlags[level]};
+		return;
+	}
+	output->write(&header[33], sizeof(header) - 33);  // IDAT header and zlib header
 
 	crc = 0;
 	crc32(&header[37], 6);  // 0xD7245B6B
 }
 
 
+TinyPngOut::~TinyPngOut() = default;
+
+
 void TinyPngOut::write(const uint8_t pixels[], size_t count) {
-	if (count > SIZE_MAX / 3)
+	if (deflater) {
+		writeCompressed(pixels, count);
+		return;
+	}
+	if (count > SIZE_MAX / bytesPerPixel)
 		throw std::length_error("Invalid argument");
-	count *= 3;  // Convert pixel count to byte count
+	count *= bytesPerPixel;  // Convert pixel count to byte count
 	while (count > 0) {
 		if (pixels == nullptr)
 			throw std::invalid_argument("Null pointer");
@@ -137,10 +745,8 @@ void TinyPngOut::write(const uint8_t pixels[], size_t count) {
 				n = static_cast<uint16_t>(lineSize - positionX);
 			if (count < n)
 				n = static_cast<uint16_t>(count);
-			if (static_cast<std::make_unsigned<std::streamsize>::type>(std::numeric_limits<std::streamsize>::max()) < std::numeric_limits<decltype(n)>::max())
-				n = std::min(n, static_cast<decltype(n)>(std::numeric_limits<std::streamsize>::max()));
 			assert(n > 0);
-			output.write(reinterpret_cast<const char*>(pixels), static_cast<std::streamsize>(n));
+			output->write(pixels, n);
 
 			// Update checksums
 			crc32(pixels, n);
@@ -173,32 +779,402 @@ void TinyPngOut::write(const uint8_t pixels[], size_t count) {
 				crc32(&footer[0], 4);
 				putBigUint32(crc, &footer[4]);
 				write(footer);
+				output->flush();
 			}
 		}
 	}
 }
 
 
+void TinyPngOut::writeRows(const uint8_t pixels[], uint32_t rows, std::ptrdiff_t stride) {
+	if (pixels == nullptr)
+		throw std::invalid_argument("Null pointer");
+	for (uint32_t i = 0; i < rows; i++)
+		write(pixels + static_cast<std::ptrdiff_t>(i) * stride, width);
+}
+
+
+void TinyPngOut::writeCompressed(const uint8_t pixels[], size_t count) {
+	if (count > SIZE_MAX / bytesPerPixel)
+		throw std::length_error("Invalid argument");
+	count *= bytesPerPixel;  // Convert pixel count to byte count
+	while (count > 0) {
+		if (pixels == nullptr)
+			throw std::invalid_argument("Null pointer");
+		if (positionY >= height)
+			throw std::logic_error("All image pixels already written");
+
+		if (positionX == 0)  // Beginning of line - the filter byte is chosen once the line is complete
+			positionX++;
+		size_t n = std::min(count, static_cast<size_t>(lineSize - positionX));
+		std::memcpy(&currentLine[bytesPerPixel + positionX - 1], pixels, n);
+		count -= n;
+		pixels += n;
+		positionX += static_cast<uint32_t>(n);
+
+		if (positionX == lineSize) {  // Increment line
+			writeFilteredLine();
+			if (deflater->getOutput().size() >= IDAT_CHUNK_SIZE)
+				writeIdatChunk();
+			positionX = 0;
+			positionY++;
+			if (positionY == height) {  // Reached end of pixels
+				deflater->finish();
+				uint8_t footer[4];
+				putBigUint32(adler, footer);
+				deflater->getOutput().insert(deflater->getOutput().end(), footer, footer + 4);
+				writeIdatChunk();
+				const uint8_t iend[] = {
+					0x00, 0x00, 0x00, 0x00,
+					0x49, 0x45, 0x4E, 0x44,
+					0xAE, 0x42, 0x60, 0x82,
+				};
+				write(iend);
+				output->flush();
+			}
+		}
+	}
+}
+
+
+void TinyPngOut::writeFilteredLine() {
+	const uint8_t *row = &currentLine[bytesPerPixel];
+	const uint8_t *prior = &previousLine[bytesPerPixel];
+	const uint8_t *best = nullptr;
+	uint32_t bestCost = UINT32_MAX;
+	for (size_t i = 0; i < filterTypesTried; i++) {
+		uint8_t *line = &filteredLines[i * lineSize];
+		line[0] = FILTER_TYPES[i];
+		uint32_t cost = filterRow(FILTER_TYPES[i], row, prior, line + 1, lineSize - 1, bytesPerPixel);
+		if (cost < bestCost) {
+			bestCost = cost;
+			best = line;
+		}
+	}
+	deflater->write(best, lineSize);
+	adler32(best, lineSize);
+	std::swap(currentLine, previousLine);
+}
+
+
+void TinyPngOut::writeIdatChunk() {
+	std::vector<uint8_t> &data = deflater->getOutput();
+	if (data.empty())
+		return;
+	uint8_t header[] = {
+		0, 0, 0, 0,  // Length placeholder
+		0x49, 0x44, 0x41, 0x54,
+	};
+	putBigUint32(static_cast<uint32_t>(data.size()), &header[0]);
+	crc = 0;
+	crc32(&header[4], 4);
+	crc32(data.data(), data.size());
+	uint8_t footer[4];
+	putBigUint32(crc, footer);
+	write(header);
+	output->write(data.data(), data.size());
+	write(footer);
+	data.clear();
+}
+
+
 void TinyPngOut::crc32(const uint8_t data[], size_t len) {
-	crc = ~crc;
-	for (size_t i = 0; i < len; i++) {
-		for (int j = 0; j < 8; j++) {  // Inefficient bitwise implementation, instead of table-based
-			uint32_t bit = (crc ^ (data[i] >> j)) & 1;
-			crc = (crc >> 1) ^ ((-bit) & UINT32_C(0xEDB88320));
+	crc = updateCrc32(crc, data, len);
+}
+
+
+/*---- CRC-32 engines ----*/
+
+// All the engines below work on the inverted CRC register and produce the same results:
+// updateCrc32() picks the fastest one supported by the CPU the first time it is called.
+namespace {
+
+	using CrcTables = std::array<std::array<uint32_t, 256>, 8>;
+
+	// tables[0] is the classic byte-at-a-time table; tables[k][i] is the CRC of byte i followed by k zero bytes
+	const CrcTables &crcTables() {
+		static const CrcTables tables = []() {
+			CrcTables result{};
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t c = i;
+				for (int j = 0; j < 8; j++)
+					c = (c >> 1) ^ ((-(c & 1)) & UINT32_C(0xEDB88320));
+				result[0][i] = c;
+			}
+			for (int k = 1; k < 8; k++) {
+				for (uint32_t i = 0; i < 256; i++)
+					result[k][i] = (result[k - 1][i] >> 8) ^ result[0][result[k - 1][i] & 0xFF];
+			}
+			return result;
+		}();
+		return tables;
+	}
+
+
+	// Slice-by-8: eight table lookups per 8 bytes of input, without any dependency between them
+	uint32_t crc32SliceBy8(uint32_t c, const uint8_t data[], size_t len) {
+		const CrcTables &t = crcTables();
+		for (; len >= 8; data += 8, len -= 8) {
+			uint32_t lo = c ^ (static_cast<uint32_t>(data[0]) << 0 | static_cast<uint32_t>(data[1]) << 8
+				| static_cast<uint32_t>(data[2]) << 16 | static_cast<uint32_t>(data[3]) << 24);
+			c = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+				^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+		}
+		for (; len > 0; data++, len--)
+			c = t[0][(c ^ *data) & 0xFF] ^ (c >> 8);
+		return c;
+	}
+
+
+	#ifdef TINYPNGOUT_CRC32_PCLMUL
+	// Folding with carry-less multiplications, from Intel's "Fast CRC Computation for Generic Polynomials
+	// Using PCLMULQDQ Instruction" (same constants as zlib): 4x128 bits per iteration, then a Barrett reduction.
+	// Requires len >= 64 and a multiple of 16.
+	__attribute__((target("pclmul,sse4.1")))
+	inline __m128i load128(const uint8_t *p) {
+		return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+	}
+
+	// x * k (high and low halves separately, a step of 128 or 512 bits forward) xor next
+	__attribute__((target("pclmul,sse4.1")))
+	inline __m128i fold128(__m128i x, __m128i k, __m128i next) {
+		return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00)), next);
+	}
+
+	__attribute__((target("pclmul,sse4.1")))
+	uint32_t crc32Pclmul(uint32_t c, const uint8_t data[], size_t len) {
+		const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596, 0x0154442BD4);
+		const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009E, 0x01751997D0);
+		const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163CD6124);
+		const __m128i poly = _mm_set_epi64x(0x01F7011641, 0x01DB710641);
+		const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+		__m128i x1 = _mm_xor_si128(load128(data), _mm_cvtsi32_si128(static_cast<int>(c)));
+		__m128i x2 = load128(data + 16), x3 = load128(data + 32), x4 = load128(data + 48);
+		data += 64;
+		len -= 64;
+		for (; len >= 64; data += 64, len -= 64) {
+			x1 = fold128(x1, k1k2, load128(data));
+			x2 = fold128(x2, k1k2, load128(data + 16));
+			x3 = fold128(x3, k1k2, load128(data + 32));
+			x4 = fold128(x4, k1k2, load128(data + 48));
 		}
+
+		// Fold 4x128 bits into 128, then the remaining 16-byte blocks
+		x1 = fold128(x1, k3k4, x2);
+		x1 = fold128(x1, k3k4, x3);
+		x1 = fold128(x1, k3k4, x4);
+		for (; len >= 16; data += 16, len -= 16)
+			x1 = fold128(x1, k3k4, load128(data));
+
+		// Fold 128 bits to 64, then Barrett reduction to 32
+		x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+		x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+		x2 = _mm_srli_si128(x1, 4);
+		x1 = _mm_and_si128(x1, mask32);
+		x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+
+		x2 = _mm_and_si128(x1, mask32);
+		x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+		x2 = _mm_and_si128(x2, mask32);
+		x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+		x1 = _mm_xor_si128(x1, x2);
+		return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
 	}
-	crc = ~crc;
+	#endif
+
+
+	#ifdef TINYPNGOUT_CRC32_ARMV8
+	// The ARMv8 CRC32 instructions use the same polynomial as PNG
+	__attribute__((target("+crc")))
+	uint32_t crc32Armv8(uint32_t c, const uint8_t data[], size_t len) {
+		for (; len >= 8; data += 8, len -= 8) {
+			uint64_t v;
+			std::memcpy(&v, data, 8);
+			c = __crc32d(c, v);
+		}
+		for (; len > 0; data++, len--)
+			c = __crc32b(c, *data);
+		return c;
+	}
+	#endif
+
+
+	uint32_t crc32Best(uint32_t c, const uint8_t data[], size_t len) {
+		#if defined(TINYPNGOUT_CRC32_PCLMUL)
+		static const bool hasPclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+		if (hasPclmul && len >= 64) {
+			size_t n = len & ~static_cast<size_t>(15);
+			c = crc32Pclmul(c, data, n);
+			data += n;
+			len -= n;
+		}
+		#elif defined(TINYPNGOUT_CRC32_ARMV8)
+		static const bool hasCrc = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+		if (hasCrc)
+			return crc32Armv8(c, data, len);
+		#endif
+		return crc32SliceBy8(c, data, len);
+	}
+
+}
+
+
+uint32_t TinyPngOut::updateCrc32(uint32_t crc, const uint8_t data[], size_t len) {
+	return ~crc32Best(~crc, data, len);
 }
 
 
 void TinyPngOut::adler32(const uint8_t data[], size_t len) {
+	adler = updateAdler32(adler, data, len);
+}
+
+
+/*---- Adler-32 engines ----*/
+
+// Every engine adds a block of 32*n bytes to (s1, s2) without taking the modulo: the caller
+// keeps the blocks within ADLER_NMAX bytes, so that nothing overflows 32 bits.
+namespace {
+
+	constexpr uint32_t ADLER_MOD = 65521;
+	constexpr size_t ADLER_NMAX = 5552;  // Largest n such that 255n(n+1)/2 + (n+1)(ADLER_MOD-1) < 2^32
+	constexpr size_t ADLER_BLOCK = 32;
+
+
+	void adler32Scalar(uint32_t &s1, uint32_t &s2, const uint8_t data[], size_t len) {
+		for (size_t i = 0; i < len; i++) {
+			s1 += data[i];
+			s2 += s1;
+		}
+	}
+
+
+	#ifdef TINYPNGOUT_ADLER32_X86
+	// s1 is the plain sum of the bytes (psadbw against zero), s2 the sum of the bytes weighted
+	// 32..1 within each block (pmaddubsw) plus 32 times the s1 at the start of each block
+	__attribute__((target("ssse3")))
+	void adler32Ssse3(uint32_t &s1, uint32_t &s2, const uint8_t data[], size_t blocks) {
+		const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+		const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i ones = _mm_set1_epi16(1);
+
+		__m128i vs1 = _mm_cvtsi32_si128(static_cast<int>(s1));
+		__m128i vs2 = _mm_cvtsi32_si128(static_cast<int>(s2));
+		__m128i vPreviousS1 = zero;
+		for (; blocks > 0; data += ADLER_BLOCK, blocks--) {
+			__m128i bytes1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+			__m128i bytes2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+			vPreviousS1 = _mm_add_epi32(vPreviousS1, vs1);
+			vs1 = _mm_add_epi32(vs1, _mm_add_epi32(_mm_sad_epu8(bytes1, zero), _mm_sad_epu8(bytes2, zero)));
+			vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+			vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+		}
+		vs2 = _mm_add_epi32(vs2, _mm_slli_epi32(vPreviousS1, 5));
+
+		// Horizontal sums (psadbw only fills lanes 0 and 2 of vs1)
+		vs1 = _mm_add_epi32(vs1, _mm_shuffle_epi32(vs1, _MM_SHUFFLE(1, 0, 3, 2)));
+		vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(1, 0, 3, 2)));
+		vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(2, 3, 0, 1)));
+		s1 = static_cast<uint32_t>(_mm_cvtsi128_si32(vs1));
+		s2 = static_cast<uint32_t>(_mm_cvtsi128_si32(vs2));
+	}
+
+
+	// Same as the SSSE3 version, with a whole 32-byte block per register
+	__attribute__((target("avx2")))
+	void adler32Avx2(uint32_t &s1, uint32_t &s2, const uint8_t data[], size_t blocks) {
+		const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+			16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i ones = _mm256_set1_epi16(1);
+
+		__m256i vs1 = _mm256_setr_epi32(static_cast<int>(s1), 0, 0, 0, 0, 0, 0, 0);
+		__m256i vs2 = _mm256_setr_epi32(static_cast<int>(s2), 0, 0, 0, 0, 0, 0, 0);
+		__m256i vPreviousS1 = zero;
+		for (; blocks > 0; data += ADLER_BLOCK, blocks--) {
+			__m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+			vPreviousS1 = _mm256_add_epi32(vPreviousS1, vs1);
+			vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(bytes, zero));
+			vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+		}
+		vs2 = _mm256_add_epi32(vs2, _mm256_slli_epi32(vPreviousS1, 5));
+
+		__m128i s1Sum = _mm_add_epi32(_mm256_castsi256_si128(vs1), _mm256_extracti128_si256(vs1, 1));
+		__m128i s2Sum = _mm_add_epi32(_mm256_castsi256_si128(vs2), _mm256_extracti128_si256(vs2, 1));
+		s1Sum = _mm_add_epi32(s1Sum, _mm_shuffle_epi32(s1Sum, _MM_SHUFFLE(1, 0, 3, 2)));
+		s2Sum = _mm_add_epi32(s2Sum, _mm_shuffle_epi32(s2Sum, _MM_SHUFFLE(1, 0, 3, 2)));
+		s2Sum = _mm_add_epi32(s2Sum, _mm_shuffle_epi32(s2Sum, _MM_SHUFFLE(2, 3, 0, 1)));
+		s1 = static_cast<uint32_t>(_mm_cvtsi128_si32(s1Sum));
+		s2 = static_cast<uint32_t>(_mm_cvtsi128_si32(s2Sum));
+	}
+	#endif
+
+
+	#ifdef TINYPNGOUT_ADLER32_NEON
+	// The bytes are summed per column in 16-bit lanes (at most 173 blocks of 255, no overflow),
+	// and weighted 32..1 only once at the end of the run
+	void adler32Neon(uint32_t &s1, uint32_t &s2, const uint8_t data[], size_t blocks) {
+		static const uint16_t taps[32] = {32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+			16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
+
+		uint32x4_t vs1 = vsetq_lane_u32(s1, vdupq_n_u32(0), 0);
+		uint32x4_t vPreviousS1 = vdupq_n_u32(0);
+		uint16x8_t columns[4] = {vdupq_n_u16(0), vdupq_n_u16(0), vdupq_n_u16(0), vdupq_n_u16(0)};
+		for (; blocks > 0; data += ADLER_BLOCK, blocks--) {
+			uint8x16_t bytes1 = vld1q_u8(data);
+			uint8x16_t bytes2 = vld1q_u8(data + 16);
+			vPreviousS1 = vaddq_u32(vPreviousS1, vs1);
+			vs1 = vpadalq_u16(vs1, vpadalq_u8(vpaddlq_u8(bytes1), bytes2));
+			columns[0] = vaddw_u8(columns[0], vget_low_u8(bytes1));
+			columns[1] = vaddw_u8(columns[1], vget_high_u8(bytes1));
+			columns[2] = vaddw_u8(columns[2], vget_low_u8(bytes2));
+			columns[3] = vaddw_u8(columns[3], vget_high_u8(bytes2));
+		}
+
+		uint32x4_t vs2 = vshlq_n_u32(vPreviousS1, 5);
+		for (int i = 0; i < 4; i++) {
+			uint16x8_t tap = vld1q_u16(&taps[8 * i]);
+			vs2 = vmlal_u16(vs2, vget_low_u16(columns[i]), vget_low_u16(tap));
+			vs2 = vmlal_u16(vs2, vget_high_u16(columns[i]), vget_high_u16(tap));
+		}
+		s1 = vaddvq_u32(vs1);
+		s2 += vaddvq_u32(vs2);
+	}
+	#endif
+
+
+	void adler32Blocks(uint32_t &s1, uint32_t &s2, const uint8_t data[], size_t blocks) {
+		#if defined(TINYPNGOUT_ADLER32_X86)
+		static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+		static const bool hasSsse3 = __builtin_cpu_supports("ssse3");
+		if (hasAvx2)
+			return adler32Avx2(s1, s2, data, blocks);
+		if (hasSsse3)
+			return adler32Ssse3(s1, s2, data, blocks);
+		#elif defined(TINYPNGOUT_ADLER32_NEON)
+		return adler32Neon(s1, s2, data, blocks);
+		#endif
+		adler32Scalar(s1, s2, data, blocks * ADLER_BLOCK);
+	}
+
+}
+
+
+uint32_t TinyPngOut::updateAdler32(uint32_t adler, const uint8_t data[], size_t len) {
 	uint32_t s1 = adler & 0xFFFF;
 	uint32_t s2 = adler >> 16;
-	for (size_t i = 0; i < len; i++) {
-		s1 = (s1 + data[i]) % 65521;
-		s2 = (s2 + s1) % 65521;
+	while (len > 0) {
+		size_t n = std::min(len, ADLER_NMAX);
+		size_t blocks = n / ADLER_BLOCK;
+		adler32Blocks(s1, s2, data, blocks);
+		adler32Scalar(s1, s2, data + blocks * ADLER_BLOCK, n - blocks * ADLER_BLOCK);
+		s1 %= ADLER_MOD;
+		s2 %= ADLER_MOD;
+		data += n;
+		len -= n;
 	}
-	adler = s2 << 16 | s1;
+	return s2 << 16 | s1;
 }
 
 
@@ -0,0 +1,39 @@
+#version 330 core
+
+// annulus generated from gl_VertexID alone, without any buffer: segment i of `resolution` spans the angles
+// 2*pi*i/resolution to 2*pi*(i+1)/resolution with two separate triangles (corners in cornerIsExternal and
+// cornerSegmentOffset), so draw it as GL_TRIANGLES with 6*resolution vertices. It covers the same area as addArc() in
+// main.cpp, which builds the whole annulus as one triangle strip instead
+
+uniform vec3 center;
+uniform float internalRadius;
+uniform float externalRadius;
+uniform int resolution;
+uniform vec4 color;
+uniform int dashLength; // visible segments in every dash period
+uniform int dashPeriod; // in segments, 0 for a continuous annulus
+
+flat out vec4 fragCol; // must match fragment_shader.glsl
+
+uniform mat4 view;
+uniform mat4 projection;
+
+const bool cornerIsExternal[6] = bool[6](false, false, true, false, true, true);
+const int cornerSegmentOffset[6] = int[6](0, 1, 0, 1, 0, 1);
+
+void main() {
+	int segment = gl_VertexID / 6;
+	int corner = gl_VertexID % 6;
+
+	if (dashPeriod != 0 && segment % dashPeriod >= dashLength) {
+		gl_Position = vec4(2.0, 2.0, 2.0, 1.0); // outside of the clip volume, the triangle is discarded
+		fragCol = color;
+		return;
+	}
+
+	float angle = 6.283185307179586 * float(segment + cornerSegmentOffset[corner]) / float(resolution);
+	float radius = cornerIsExternal[corner] ? externalRadius : internalRadius;
+
+	gl_Position = projection * view * vec4(center.x + radius*cos(angle), center.y, center.z + radius*sin(angle), 1.0);
+	fragCol = color;
+}
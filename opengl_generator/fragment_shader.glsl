@@ -1,6 +1,6 @@
 #version 330 core
 
-in vec4 fragCol;
+flat in vec4 fragCol;
 
 out vec4 outColor;
 
@@ -0,0 +1,12 @@
+#version 330 core
+
+// luma of the rendered frame for the grey screenshots, with the Rec. 601 weights of cv2.cvtColor(..., COLOR_RGB2GRAY),
+// drawn over the whole screen with raycast_vertex_shader.glsl into a single-channel target
+
+uniform sampler2D frame;
+
+out float luma;
+
+void main() {
+	luma = dot(texelFetch(frame, ivec2(gl_FragCoord.xy), 0).rgb, vec3(0.299, 0.587, 0.114));
+}
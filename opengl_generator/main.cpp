@@ -1,14 +1,31 @@
 /*
-g++ -std=c++17 -O3 -Iglad/include -ITinyPngOut/include -Inlohmannjson/include main.cpp glad/src/glad.c TinyPngOut/src/TinyPngOut.cpp -lSOIL -lstdc++fs -lGL -lGLU -lglfw3 -lX11 -lXxf86vm -lXrandr -lpthread -lXi -ldl -lXinerama -lXcursor && ./a.out
+g++ -std=c++17 -O3 -Iglad/include -ITinyPngOut/include -IQoiOut/include -Inlohmannjson/include main.cpp glad/src/glad.c TinyPngOut/src/TinyPngOut.cpp TinyPngOut/src/OutputSink.cpp QoiOut/src/QoiOut.cpp -lSOIL -lstdc++fs -lGL -lGLU -lglfw3 -lX11 -lXxf86vm -lXrandr -lpthread -lXi -ldl -lXinerama -lXcursor -lEGL && ./a.out
+
+headless only (no X11/GLFW needed, set "backend": "headless" in params.json):
+g++ -std=c++17 -O3 -DNO_GLFW -Iglad/include -ITinyPngOut/include -IQoiOut/include -Inlohmannjson/include main.cpp glad/src/glad.c TinyPngOut/src/TinyPngOut.cpp TinyPngOut/src/OutputSink.cpp QoiOut/src/QoiOut.cpp -lstdc++fs -lEGL -lpthread -ldl && ./a.out
 */
 #include <glad/glad.h>
+#ifndef NO_GLFW
 #include <GLFW/glfw3.h>
+#endif
+#ifndef NO_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
 #include <TinyPngOut.hpp>
+#include <OutputSink.hpp>
+#include <QoiOut.hpp>
 #include <nlohmann/json.hpp>
 using namespace nlohmann;
 
@@ -16,19 +33,77 @@ using namespace nlohmann;
 #include <string>
 #include <fstream>
 #include <vector>
-#include <functional>
 #include <numeric>
 #include <chrono>
 #include <thread>
 #include <random>
 #include <iomanip>
 #include <filesystem>
+#include <cstring>
+#include <array>
+#include <algorithm>
+#include <sstream>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <memory>
+#include <utility>
+#include <system_error>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 
 struct Color {
 	float r, g, b, a = 1.0f;
 };
 
+// vertex of the scene geometry, 16 bytes: color in normalized RGBA8
+struct PackedVertex {
+	float x, y, z;
+	uint8_t r, g, b, a;
+
+	PackedVertex() = default;
+	PackedVertex(float x, float y, float z, const Color& color)
+		: x{x}, y{y}, z{z}, r{toByte(color.r)}, g{toByte(color.g)}, b{toByte(color.b)}, a{toByte(color.a)} {}
+
+	private: static uint8_t toByte(float c) {
+		return (uint8_t) std::lround(std::min(std::max(c, 0.0f), 1.0f) * 255);
+	}
+};
+static_assert(sizeof(PackedVertex) == 16);
+
+// an annulus lying on the horizontal plane y = y0, centered in (x0, z0); in double precision since
+// radii can reach tens of kilometers while the street is only a few meters wide
+struct Annulus {
+	double x0, y0, z0;
+	double internalRadius, externalRadius;
+	int resolution;
+	bool isLine; // painted line or street surface
+};
+
+// a part of an annulus, between two angles in radians
+struct Arc {
+	double startAngle, endAngle;
+	int resolution;
+};
+
+// pitch of the camera (which sits in the origin looking towards -z) and its frustum
+struct Camera {
+	float inclination, fovy;
+	unsigned int width, height;
+	float near = 0.01f, far = 100.0f;
+};
+
+// how an annulus generated on the GPU looks like; dashes are measured in segments
+struct AnnulusStyle {
+	Color color;
+	int dashLength = 0, dashPeriod = 0; // period 0 means continuous
+};
+
 
 std::string getFileContent(std::string filename) {
 	std::ifstream file(filename);
@@ -36,6 +111,945 @@ std::string getFileContent(std::string filename) {
 		std::istreambuf_iterator<char>());
 }
 
+// Vertex buffer for data that changes every frame, split in regions used in turn: while the GPU draws from one
+// region the CPU writes the next frame into another one, and waits on a fence only if the GPU is that late.
+// With OpenGL 4.4 the buffer is persistently mapped; otherwise each region is mapped unsynchronized, and the
+// whole buffer is orphaned when wrapping around instead of waiting for the GPU.
+class StreamingBuffer {
+	private: unsigned int vbo;
+	private: size_t stride, nrRegions, regionSize, currentRegion;
+	private: std::vector<GLsync> fences;
+	private: bool persistent;
+	private: uint8_t* mapping; // whole buffer, only when persistent
+
+	public: void init(size_t nrRegionsValue, size_t strideValue) {
+		glGenBuffers(1, &vbo);
+		stride = strideValue;
+		nrRegions = nrRegionsValue;
+		regionSize = 0;
+		currentRegion = 0;
+		fences.assign(nrRegions, nullptr);
+		persistent = GLAD_GL_VERSION_4_4;
+		mapping = nullptr;
+	}
+
+	public: void release() {
+		for (auto&& fence : fences) {
+			waitFence(fence);
+		}
+		if (mapping != nullptr) {
+			glBindBuffer(GL_ARRAY_BUFFER, vbo);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+		}
+		glDeleteBuffers(1, &vbo);
+	}
+
+	public: unsigned int getBuffer() const {
+		return vbo;
+	}
+
+	// copies the data in the next region and returns the index of its first element; the buffer object
+	// may be replaced when growing (reallocated is set to true), in which case the VAO has to be set up again
+	public: size_t write(const void* data, size_t size, bool& reallocated) {
+		reallocated = false;
+		if (size == 0) {
+			return currentRegion * regionSize / stride; // nothing to draw, and mapping 0 bytes is an error
+		}
+		if (size > regionSize) {
+			grow(size);
+			reallocated = persistent;
+		}
+
+		currentRegion = (currentRegion + 1) % nrRegions;
+		size_t offset = currentRegion * regionSize;
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		if (persistent) {
+			waitFence(fences[currentRegion]); // the GPU may still be drawing from this region
+			std::memcpy(mapping + offset, data, size);
+		} else {
+			if (currentRegion == 0) {
+				glBufferData(GL_ARRAY_BUFFER, nrRegions * regionSize, nullptr, GL_STREAM_DRAW); // orphan
+			}
+			void* region = glMapBufferRange(GL_ARRAY_BUFFER, offset, size,
+				GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+			std::memcpy(region, data, size);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+		}
+		return offset / stride;
+	}
+
+	// to be called after the draw calls using the last written region
+	public: void fence() {
+		if (persistent) {
+			waitFence(fences[currentRegion]);
+			fences[currentRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+	}
+
+	private: static void waitFence(GLsync& fence) {
+		if (fence != nullptr) {
+			while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+			glDeleteSync(fence);
+			fence = nullptr;
+		}
+	}
+
+	private: void grow(size_t size) {
+		// regions are multiples of the stride, so that offsets are whole elements
+		size_t newRegionSize = std::max(regionSize, stride * 1024);
+		while (newRegionSize < size) {
+			newRegionSize *= 2;
+		}
+		regionSize = newRegionSize;
+		currentRegion = nrRegions - 1; // the next write goes in region 0
+
+		if (!persistent) {
+			glBindBuffer(GL_ARRAY_BUFFER, vbo);
+			glBufferData(GL_ARRAY_BUFFER, nrRegions * regionSize, nullptr, GL_STREAM_DRAW);
+			return;
+		}
+
+		// immutable storage cannot be resized: wait for the GPU to be done with it and make a new one
+		release();
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, nrRegions * regionSize, nullptr, flags);
+		mapping = (uint8_t*) glMapBufferRange(GL_ARRAY_BUFFER, 0, nrRegions * regionSize, flags);
+		if (mapping == nullptr) {
+			throw std::runtime_error("Failed to map streaming vertex buffer");
+		}
+	}
+};
+
+
+// lock-free queue of fixed capacity (rounded up to a power of two, at least 2) for any number of producers and consumers,
+// after Dmitry Vyukov's bounded MPMC queue: the sequence number of each cell tells whether it is free for the
+// producer or full for the consumer of the current lap, so the two sides only contend on their own position
+template <typename T>
+class BoundedQueue {
+	private: struct Cell {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	private: std::unique_ptr<Cell[]> cells;
+	private: size_t mask;
+	private: alignas(64) std::atomic<size_t> enqueuePosition; // on separate cache lines, producers and consumers
+	private: alignas(64) std::atomic<size_t> dequeuePosition; // do not invalidate each other's counter
+
+	public: explicit BoundedQueue(size_t minCapacity) : enqueuePosition{0}, dequeuePosition{0} {
+		size_t capacity = 2; // with a single cell, the sequence of a popped value would read as a pushed one
+		while (capacity < minCapacity) {
+			capacity *= 2;
+		}
+		cells.reset(new Cell[capacity]);
+		mask = capacity - 1;
+		for (size_t i = 0; i != capacity; ++i) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	public: size_t capacity() const {
+		return mask + 1;
+	}
+
+	// moves the value into the queue, or returns false (leaving it untouched) if the queue is full
+	public: bool tryPush(T& value) {
+		size_t position = enqueuePosition.load(std::memory_order_relaxed);
+		while (true) {
+			Cell& cell = cells[position & mask];
+			size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			ptrdiff_t lap = (ptrdiff_t) (sequence - position);
+			if (lap == 0) {
+				if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					cell.value = std::move(value);
+					cell.sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (lap < 0) {
+				return false; // the cell still holds the value of the previous lap
+			} else {
+				position = enqueuePosition.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// moves the oldest value out of the queue, or returns false if the queue is empty
+	public: bool tryPop(T& value) {
+		size_t position = dequeuePosition.load(std::memory_order_relaxed);
+		while (true) {
+			Cell& cell = cells[position & mask];
+			size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			ptrdiff_t lap = (ptrdiff_t) (sequence - (position + 1));
+			if (lap == 0) {
+				if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					value = std::move(cell.value);
+					cell.sequence.store(position + mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (lap < 0) {
+				return false; // nothing was pushed in the cell yet
+			} else {
+				position = dequeuePosition.load(std::memory_order_relaxed);
+			}
+		}
+	}
+};
+
+
+// background threads running `process` on the jobs submitted by a single producer (the render loop); the queue to
+// the workers is bounded and submit() blocks while it is full, so a producer faster than the workers is slowed
+// down instead of piling up jobs in memory. Processed jobs are handed back by reuse(), to recycle their buffers.
+// Threads sleep on a condition variable only when there is nothing to do: the queues themselves are lock-free.
+// With 0 threads the jobs are processed directly in submit().
+template <typename Job>
+class WorkerPool {
+	private: BoundedQueue<Job> pending, processed;
+	private: const std::function<void(Job&)> process;
+	private: std::vector<std::thread> threads;
+
+	private: std::mutex sleepMutex; // only taken to sleep, or to wake up a sleeping thread
+	private: std::condition_variable workAvailable, jobFinished;
+	private: std::atomic<size_t> nrSleepingWorkers;
+	private: std::atomic<bool> producerSleeping;
+	private: bool stopping; // guarded by sleepMutex
+
+	private: std::atomic<size_t> nrFinished;
+	private: size_t nrSubmitted;
+	private: std::atomic<int64_t> processNanoseconds; // summed over all threads
+	private: std::chrono::duration<double> blockedTime; // spent by the producer waiting for the workers
+
+	private: std::mutex errorMutex;
+	private: std::exception_ptr error; // the first one thrown by `process`, rethrown to the producer
+
+	public: WorkerPool(size_t nrThreads, size_t queueSize, std::function<void(Job&)> processFunction)
+			: pending(std::max(queueSize, (size_t) 1)), processed(pending.capacity() + nrThreads + 1),
+				process{std::move(processFunction)}, nrSleepingWorkers{0}, producerSleeping{false}, stopping{false},
+				nrFinished{0}, nrSubmitted{0}, processNanoseconds{0}, blockedTime{0} {
+		for (size_t i = 0; i != nrThreads; ++i) {
+			threads.emplace_back(&WorkerPool::work, this);
+		}
+	}
+
+	// processes the jobs still queued, then stops the threads
+	public: ~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock{sleepMutex};
+			stopping = true;
+		}
+		workAvailable.notify_all();
+		for (auto&& thread : threads) {
+			thread.join();
+		}
+	}
+
+	public: WorkerPool(const WorkerPool&) = delete;
+	public: WorkerPool& operator=(const WorkerPool&) = delete;
+
+	// takes back a processed job with its buffers, returns false if there is none yet
+	public: bool reuse(Job& job) {
+		return processed.tryPop(job);
+	}
+
+	// queues the job (moving it), waiting for a free place if all are taken
+	public: void submit(Job& job) {
+		rethrowError();
+		++nrSubmitted;
+		if (threads.empty()) {
+			runJob(job);
+			processed.tryPush(job);
+			return;
+		}
+
+		if (!pending.tryPush(job)) {
+			auto waitStart = std::chrono::steady_clock::now();
+			sleepUntil([&]() { return pending.tryPush(job); });
+			blockedTime += std::chrono::steady_clock::now() - waitStart;
+		}
+		std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in waitForJob()
+		if (nrSleepingWorkers.load() != 0) {
+			std::lock_guard<std::mutex> lock{sleepMutex};
+			workAvailable.notify_one();
+		}
+	}
+
+	// waits for all the submitted jobs to be processed
+	public: void wait() {
+		if (nrFinished.load() != nrSubmitted) {
+			auto waitStart = std::chrono::steady_clock::now();
+			sleepUntil([&]() { return nrFinished.load() == nrSubmitted; });
+			blockedTime += std::chrono::steady_clock::now() - waitStart;
+		}
+		rethrowError();
+	}
+
+	public: size_t getNrThreads() const {
+		return threads.size();
+	}
+
+	public: size_t getQueueSize() const {
+		return pending.capacity();
+	}
+
+	public: std::chrono::duration<double> getProcessTime() const {
+		return std::chrono::nanoseconds{processNanoseconds.load()};
+	}
+
+	public: std::chrono::duration<double> getBlockedTime() const {
+		return blockedTime;
+	}
+
+	private: void rethrowError() {
+		std::lock_guard<std::mutex> lock{errorMutex};
+		if (error) {
+			std::rethrow_exception(std::exchange(error, nullptr));
+		}
+	}
+
+	// called by the producer, the workers wake it up after each job
+	private: template <typename Condition>
+	void sleepUntil(Condition done) {
+		std::unique_lock<std::mutex> lock{sleepMutex};
+		producerSleeping.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in work()
+		while (!done()) {
+			jobFinished.wait(lock);
+		}
+		producerSleeping.store(false);
+	}
+
+	// returns false once the pool is stopping and no job is left
+	private: bool waitForJob(Job& job) {
+		if (pending.tryPop(job)) {
+			return true;
+		}
+		std::unique_lock<std::mutex> lock{sleepMutex};
+		nrSleepingWorkers.fetch_add(1);
+		// either submit() sees this thread sleeping (and has to take the lock to wake it up, which it can only do
+		// once the thread waits) or this thread sees the job it pushed
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool found;
+		while (true) {
+			bool stop = stopping; // read before looking at the queue one last time, all jobs were pushed by now
+			found = pending.tryPop(job);
+			if (found || stop) {
+				break;
+			}
+			workAvailable.wait(lock);
+		}
+		nrSleepingWorkers.fetch_sub(1);
+		return found;
+	}
+
+	private: void runJob(Job& job) {
+		{
+			std::lock_guard<std::mutex> lock{errorMutex};
+			if (error) {
+				nrFinished.fetch_add(1);
+				return; // the producer is going to stop anyway, the job is dropped
+			}
+		}
+		auto start = std::chrono::steady_clock::now();
+		try {
+			process(job);
+		} catch (...) {
+			std::lock_guard<std::mutex> lock{errorMutex};
+			if (!error) {
+				error = std::current_exception();
+			}
+		}
+		processNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		nrFinished.fetch_add(1);
+	}
+
+	private: void work() {
+		Job job;
+		while (waitForJob(job)) {
+			runJob(job);
+			processed.tryPush(job); // never full: it has room for every job in flight
+			std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in sleepUntil()
+			if (producerSleeping.load()) {
+				std::lock_guard<std::mutex> lock{sleepMutex};
+				jobFinished.notify_one();
+			}
+		}
+	}
+};
+
+
+// what a sample shows, stored next to it in the index of the dataset shards
+struct SampleLabel {
+	double radius = 0;           // meters, negative when the street turns left (as in the file names)
+	float cameraHeight = 0;      // meters
+	float cameraInclination = 0; // radians
+	float fovy = 0;              // radians
+	uint64_t sample = 0;         // index of the sample, which regenerates it together with the seed (see RandomKey)
+};
+
+
+// writes the samples into large append-only shard files instead of a file each, with their labels in a fixed-size
+// index that readers can mmap and access randomly (see dataset.py); numbers are little-endian. A shard is laid out as
+//   header (64 bytes) | index: `capacity` entries of 40 bytes | encoded images, one after the other
+// and is named by its number, e.g. 00000.shard. A shard starts with a header counting 0 entries, rewritten after the
+// index when the shard is full or closed, so a shard interrupted by a crash reads as empty. append() can be called by
+// any thread.
+class DatasetWriter {
+	public: struct ShardHeader {
+		char magic[8];          // "SGSHARD" and a zero
+		uint32_t version;
+		uint32_t headerSize;    // sizeof(ShardHeader)
+		uint32_t entrySize;     // sizeof(IndexEntry)
+		uint32_t capacity;      // entries in the index
+		uint64_t count;         // entries used
+		uint64_t indexOffset;
+		uint64_t payloadOffset;
+		uint32_t width, height; // of all the images
+		uint8_t fileFormat;     // Renderer::FileFormat of the images: 0 PNG, 1 QOI
+		uint8_t pixelFormat;    // Renderer::ScreenshotFormat they were read back in: 0 RGB, 1 grey, 2 palette
+		uint8_t reserved[6];
+	};
+
+	public: struct IndexEntry {
+		uint64_t offset;        // of the encoded image, from the start of the file
+		uint32_t length;
+		float cameraHeight;
+		double radius;
+		uint64_t sample;
+		float cameraInclination;
+		float fovy;
+	};
+
+	static_assert(sizeof(ShardHeader) == 64 && sizeof(IndexEntry) == 40, "the shard layout has no padding");
+	#if defined(__BYTE_ORDER__)
+	static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "shards are written in the byte order of the CPU");
+	#endif
+
+	private: const std::string directory;
+	private: ShardHeader header;
+	private: std::vector<IndexEntry> index; // of the open shard
+	private: int fd;
+	private: std::string path;
+	private: uint64_t end;
+	private: size_t nrShards, nrSamples;
+	private: std::mutex mutex;
+
+	public: DatasetWriter(const std::string& directoryPath, size_t samplesPerShard, unsigned int width, unsigned int height,
+			uint8_t fileFormat, uint8_t pixelFormat)
+			: directory{directoryPath}, header{}, fd{-1}, end{0}, nrShards{0}, nrSamples{0} {
+		std::memcpy(header.magic, "SGSHARD", 8);
+		header.version = 2; // 1 had no sample index
+		header.headerSize = sizeof(ShardHeader);
+		header.entrySize = sizeof(IndexEntry);
+		header.capacity = (uint32_t) std::clamp(samplesPerShard, (size_t) 1, (size_t) UINT32_MAX / sizeof(IndexEntry));
+		header.indexOffset = sizeof(ShardHeader);
+		header.payloadOffset = header.indexOffset + (uint64_t) header.capacity * sizeof(IndexEntry);
+		header.width = width;
+		header.height = height;
+		header.fileFormat = fileFormat;
+		header.pixelFormat = pixelFormat;
+		index.reserve(header.capacity);
+	}
+
+	// closes the open shard, ignoring errors: call close() to get them
+	public: ~DatasetWriter() {
+		try {
+			close();
+		} catch (...) {}
+	}
+
+	public: DatasetWriter(const DatasetWriter&) = delete;
+	public: DatasetWriter& operator=(const DatasetWriter&) = delete;
+
+	// stores the encoded image of a sample at the end of the open shard, starting a new one when it is full
+	public: void append(const uint8_t* data, size_t size, const SampleLabel& label) {
+		if (size > UINT32_MAX) {
+			throw std::length_error("Sample too large for a dataset shard");
+		}
+		// writing the payload is just a copy into the page cache, much shorter than encoding it: one lock is enough
+		std::lock_guard<std::mutex> lock{mutex};
+		if (fd != -1 && index.size() == header.capacity) {
+			closeShard();
+		}
+		if (fd == -1) {
+			openShard();
+		}
+		writeAt(data, size, end);
+		index.push_back({end, (uint32_t) size, label.cameraHeight, label.radius, label.sample, label.cameraInclination, label.fovy});
+		end += size;
+		++nrSamples;
+	}
+
+	// writes the index of the open shard and closes it, the next append() starts a new shard
+	public: void close() {
+		std::lock_guard<std::mutex> lock{mutex};
+		if (fd != -1) {
+			closeShard();
+		}
+	}
+
+	public: size_t getNrShards() const {
+		return nrShards;
+	}
+
+	public: size_t getNrSamples() const {
+		return nrSamples;
+	}
+
+	private: void openShard() {
+		std::ostringstream name;
+		name << directory << "/" << std::setfill('0') << std::setw(5) << nrShards << ".shard";
+		path = name.str();
+		fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			throw std::system_error(errno, std::generic_category(), "Opening " + path);
+		}
+		++nrShards;
+		index.clear();
+		end = header.payloadOffset; // the index stays a hole in the file until closeShard()
+		header.count = 0;
+		try {
+			writeAt(&header, sizeof(header), 0);
+		} catch (...) {
+			::close(fd);
+			fd = -1;
+			throw;
+		}
+	}
+
+	private: void closeShard() {
+		header.count = index.size();
+		try {
+			writeAt(index.data(), index.size() * sizeof(IndexEntry), header.indexOffset);
+			writeAt(&header, sizeof(header), 0);
+		} catch (...) {
+			::close(fd);
+			fd = -1;
+			throw;
+		}
+		int result = ::close(fd);
+		fd = -1;
+		if (result != 0) {
+			throw std::system_error(errno, std::generic_category(), "Closing " + path);
+		}
+	}
+
+	private: void writeAt(const void* data, size_t size, uint64_t offset) {
+		auto bytes = (const uint8_t*) data;
+		while (size > 0) {
+			ssize_t written = ::pwrite(fd, bytes, size, (off_t) offset);
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw std::system_error(errno, std::generic_category(), "Writing " + path);
+			}
+			bytes += written;
+			size -= written;
+			offset += written;
+		}
+	}
+};
+
+
+// the street rectangle that image_manipulator.getStreetRect() warps out of each frame to look for the road curve:
+// maps the pixels of the `width`x`height` rectangle to the frame (top-down coordinates, pixel centers at integers)
+struct StreetRect {
+	unsigned int width = 0, height = 0;
+	double a, b, c, d, e, f, g, h; // homography from the unit square to the corners in the frame
+
+	void map(unsigned int x, unsigned int y, double& frameX, double& frameY) const {
+		double u = width > 1 ? (double) x / (width - 1) : 0, v = height > 1 ? (double) y / (height - 1) : 0;
+		double w = g * u + h * v + 1;
+		frameX = (a * u + b * v + c) / w;
+		frameY = (d * u + e * v + f) / w;
+	}
+};
+
+// same corners and size as getStreetRect() and getTargetHeight() in image_manipulator.py
+StreetRect getStreetRect(unsigned int width, unsigned int height, float cameraInclination, float fovy,
+		float upperRectLineHeight, unsigned int targetWidth) {
+	double screenRatio = (double) width / height;
+	double tanLineAngle = (tan(cameraInclination) / tan(fovy/2) + 1) / screenRatio;
+	double x = upperRectLineHeight, y = tanLineAngle * x;
+	if (y > 1/screenRatio) {
+		y = 1/screenRatio;
+		x = y / tanLineAngle;
+	}
+	const double corners[4][2] = {{x*width, height - y*width}, {(1-x)*width, height - y*width}, {(double) width, (double) height}, {0, (double) height}};
+
+	double alpha1 = M_PI_2 - cameraInclination;
+	double alpha2 = M_PI_2 - atan(tan(fovy/2) * (1 - 2*y*screenRatio));
+	StreetRect rect;
+	rect.width = targetWidth;
+	rect.height = (unsigned int) std::max(targetWidth * (sin(alpha2) / sin(M_PI - alpha1 - alpha2) * y*screenRatio), 0.0);
+
+	// square-to-quadrilateral mapping of Heckbert's "Fundamentals of Texture Mapping", the corners being the
+	// images of (0,0), (1,0), (1,1) and (0,1)
+	auto [x0, y0] = corners[0];
+	auto [x1, y1] = corners[1];
+	auto [x2, y2] = corners[2];
+	auto [x3, y3] = corners[3];
+	double dx1 = x1 - x2, dx2 = x3 - x2, dx3 = x0 - x1 + x2 - x3;
+	double dy1 = y1 - y2, dy2 = y3 - y2, dy3 = y0 - y1 + y2 - y3;
+	double denominator = dx1 * dy2 - dx2 * dy1;
+	rect.g = (dx3 * dy2 - dx2 * dy3) / denominator;
+	rect.h = (dx1 * dy3 - dx3 * dy1) / denominator;
+	rect.a = x1 - x0 + rect.g * x1;
+	rect.b = x3 - x0 + rect.h * x3;
+	rect.c = x0;
+	rect.d = y1 - y0 + rect.g * y1;
+	rect.e = y3 - y0 + rect.h * y3;
+	rect.f = y0;
+	return rect;
+}
+
+
+// array file in the .npy format (version 1.0) with room for `capacity` records, preallocated and mapped in memory:
+// records are written in place by any thread, and close() shrinks the first dimension to the records written
+class NpyFile {
+	private: std::string path;
+	private: int fd;
+	private: uint8_t* mapping;
+	private: std::string descr;
+	private: std::vector<size_t> recordShape;
+	private: size_t recordSize, capacity, dataOffset;
+
+	// `descr` is the numpy type of the elements (e.g. "|u1" or "<f8", or a list of fields like "[('a', '<u8')]" for a
+	// structured array), `recordShape` the dimensions after the first one
+	public: NpyFile(const std::string& filePath, const std::string& elementType, size_t elementSize,
+			const std::vector<size_t>& shape, size_t nrRecords)
+			: path{filePath}, fd{-1}, mapping{nullptr}, descr{elementType}, recordShape{shape},
+				recordSize{elementSize}, capacity{nrRecords} {
+		for (size_t dimension : recordShape) {
+			recordSize *= dimension;
+		}
+		std::string header = getHeader(capacity); // fewer records can only make it shorter
+		dataOffset = header.size();
+		size_t fileSize = dataOffset + recordSize * capacity;
+
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			throw std::system_error(errno, std::generic_category(), "Opening " + path);
+		}
+		// the blocks are reserved now, so that running out of disk space fails here rather than with a SIGBUS later
+		int result = ::posix_fallocate(fd, 0, (off_t) fileSize);
+		if (result == EOPNOTSUPP || result == EINVAL) {
+			result = ::ftruncate(fd, (off_t) fileSize) == 0 ? 0 : errno;
+		}
+		if (result == 0 && fileSize > 0) {
+			void* address = ::mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			result = address == MAP_FAILED ? errno : 0;
+			mapping = address == MAP_FAILED ? nullptr : (uint8_t*) address;
+		}
+		if (result != 0) {
+			::close(fd);
+			throw std::system_error(result, std::generic_category(), "Allocating " + path);
+		}
+		std::memcpy(mapping, header.data(), header.size());
+	}
+
+	// closes the file as if all the records were written, ignoring errors: call close() to get them
+	public: ~NpyFile() {
+		try {
+			close(capacity);
+		} catch (...) {}
+	}
+
+	public: NpyFile(const NpyFile&) = delete;
+	public: NpyFile& operator=(const NpyFile&) = delete;
+
+	public: uint8_t* getRecord(size_t i) {
+		return mapping + dataOffset + recordSize * i;
+	}
+
+	public: size_t getCapacity() const {
+		return capacity;
+	}
+
+	// writes the number of records to the header and cuts the file after the last one
+	public: void close(size_t nrRecords) {
+		if (fd == -1) {
+			return;
+		}
+		std::string header = getHeader(std::min(nrRecords, capacity));
+		std::memcpy(mapping, header.data(), header.size());
+		int result = ::munmap(mapping, dataOffset + recordSize * capacity) == 0 ? 0 : errno;
+		mapping = nullptr;
+		if (result == 0 && ::ftruncate(fd, (off_t) (dataOffset + recordSize * std::min(nrRecords, capacity))) != 0) {
+			result = errno;
+		}
+		if (::close(fd) != 0 && result == 0) {
+			result = errno;
+		}
+		fd = -1;
+		if (result != 0) {
+			throw std::system_error(result, std::generic_category(), "Closing " + path);
+		}
+	}
+
+	// magic, version 1.0, header length, then a Python dict padded with spaces so that the data is 64-byte aligned;
+	// the padding is computed for `capacity`, so that the header keeps its size for any number of records
+	private: std::string getHeader(size_t nrRecords) const {
+		std::ostringstream shape;
+		shape << "(" << nrRecords << ",";
+		for (size_t dimension : recordShape) {
+			shape << " " << dimension << ",";
+		}
+		shape << ")";
+		std::string type = descr[0] == '[' ? descr : "'" + descr + "'";
+		std::string dict = "{'descr': " + type + ", 'fortran_order': False, 'shape': " + shape.str() + ", }";
+
+		size_t maxDictSize = dict.size() + std::to_string(capacity).size() - std::to_string(nrRecords).size();
+		size_t headerSize = (10 + maxDictSize + 1 + 63) / 64 * 64;
+		dict.resize(headerSize - 10 - 1, ' ');
+		dict += '\n';
+		size_t dictSize = dict.size();
+		return std::string{"\x93NUMPY\x01\x00", 8} + (char) (dictSize & 0xFF) + (char) (dictSize >> 8) + dict;
+	}
+};
+
+
+// writes the frames as raw tensors that numpy can memory-map directly (see dataset.py), with no image decoding:
+//   images.npy       uint8 [capacity, height, width, channels], top-down RGB (channels 3) or grey (channels 1)
+//   labels.npy       float64 [capacity, 5]: radius, cameraHeight, cameraInclination, fovy, sample, as in SampleLabel
+//   streetRects.npy  uint8 [capacity, rect height, rect width, channels], only with a StreetRect
+// append() can be called by any thread, close() cuts the tensors to the samples appended.
+class TensorDatasetWriter {
+	private: const unsigned int width, height, channels;
+	private: const StreetRect streetRect;
+	private: NpyFile images, labels;
+	private: std::unique_ptr<NpyFile> streetRects;
+	private: std::atomic<size_t> nrSamples;
+
+	// the street rectangle maps to the same place in every frame: its bilinear taps are computed once
+	private: struct Tap {
+		uint32_t offsets[4];  // of the 4 neighbor pixels in the image, top-left, top-right, bottom-left, bottom-right
+		uint16_t weights[4];  // summing to 1 << WEIGHT_BITS, 0 outside of the frame
+	};
+	private: static constexpr int WEIGHT_BITS = 14;
+	private: std::vector<Tap> taps;
+
+	public: TensorDatasetWriter(const std::string& directory, size_t capacity, unsigned int w, unsigned int h,
+			unsigned int nrChannels, const StreetRect& rect = {})
+			: width{w}, height{h}, channels{nrChannels}, streetRect{rect},
+				images{directory + "/images.npy", "|u1", 1, {h, w, nrChannels}, capacity},
+				labels{directory + "/labels.npy", "<f8", sizeof(double), {5}, capacity}, nrSamples{0} {
+		if (rect.width != 0 && rect.height != 0) {
+			streetRects = std::make_unique<NpyFile>(directory + "/streetRects.npy", "|u1", 1,
+				std::vector<size_t>{rect.height, rect.width, nrChannels}, capacity);
+			computeTaps();
+		}
+	}
+
+	public: size_t getCapacity() const {
+		return images.getCapacity();
+	}
+
+	public: size_t getNrSamples() const {
+		return std::min(nrSamples.load(), getCapacity());
+	}
+
+	// copies the frame (bottom-up rows, as read back) into the next record of the tensors
+	public: void append(const uint8_t* bottomUpPixels, const SampleLabel& label) {
+		size_t i = nrSamples.fetch_add(1);
+		if (i >= getCapacity()) {
+			throw std::length_error("The tensor dataset is full");
+		}
+
+		const size_t rowSize = (size_t) width * channels;
+		uint8_t* image = images.getRecord(i);
+		for (unsigned int y = 0; y != height; ++y) {
+			std::memcpy(image + y * rowSize, bottomUpPixels + (height - 1 - y) * rowSize, rowSize);
+		}
+
+		const double values[] = {label.radius, label.cameraHeight, label.cameraInclination, label.fovy, (double) label.sample};
+		std::memcpy(labels.getRecord(i), values, sizeof(values));
+
+		if (streetRects) {
+			warpStreetRect(image, streetRects->getRecord(i));
+		}
+	}
+
+	public: void close() {
+		images.close(getNrSamples());
+		labels.close(getNrSamples());
+		if (streetRects) {
+			streetRects->close(getNrSamples());
+		}
+	}
+
+	// bilinear sampling with black outside of the frame, like cv2.warpPerspective()
+	private: void computeTaps() {
+		taps.resize((size_t) streetRect.width * streetRect.height);
+		for (unsigned int y = 0; y != streetRect.height; ++y) {
+			for (unsigned int x = 0; x != streetRect.width; ++x) {
+				double frameX, frameY;
+				streetRect.map(x, y, frameX, frameY);
+				double x0 = std::floor(frameX), y0 = std::floor(frameY);
+				double fx = frameX - x0, fy = frameY - y0;
+				const double weights[] = {(1-fx) * (1-fy), fx * (1-fy), (1-fx) * fy, fx * fy};
+
+				Tap& tap = taps[(size_t) y * streetRect.width + x];
+				int total = 0;
+				for (int i = 0; i != 4; ++i) {
+					double sx = x0 + i % 2, sy = y0 + i / 2;
+					bool inside = sx >= 0 && sy >= 0 && sx < width && sy < height;
+					tap.offsets[i] = inside ? (uint32_t) ((sy * width + sx) * channels) : 0;
+					tap.weights[i] = inside ? (uint16_t) std::lround(weights[i] * (1 << WEIGHT_BITS)) : 0;
+					total += tap.weights[i];
+				}
+				if (total > (1 << WEIGHT_BITS)) { // rounding up, at most by 2
+					*std::max_element(tap.weights, tap.weights + 4) -= total - (1 << WEIGHT_BITS);
+				}
+			}
+		}
+	}
+
+	private: void warpStreetRect(const uint8_t* image, uint8_t* rect) const {
+		for (const Tap& tap : taps) {
+			for (unsigned int c = 0; c != channels; ++c) {
+				uint32_t sum = 1 << (WEIGHT_BITS - 1);
+				for (int i = 0; i != 4; ++i) {
+					sum += tap.weights[i] * image[tap.offsets[i] + c];
+				}
+				*rect++ = (uint8_t) (sum >> WEIGHT_BITS);
+			}
+		}
+	}
+};
+
+
+// the directory of the samples generated by `--shard part/nrParts`, e.g. part-00003-of-00016
+std::string getPartDirectory(const std::string& datasetPath, size_t part, size_t nrParts) {
+	std::ostringstream name;
+	name << datasetPath << "/part-" << std::setfill('0') << std::setw(5) << part << "-of-" << std::setw(5) << nrParts;
+	return name.str();
+}
+
+// one record of index.npy, see mergeParts()
+struct MergedIndexEntry {
+	uint64_t sample;
+	double radius;
+	uint64_t record;   // position in the part: in its shards one after the other, or in its tensors
+	uint32_t part;
+	float cameraHeight;
+	float cameraInclination;
+	float fovy;
+};
+static_assert(sizeof(MergedIndexEntry) == 40, "index.npy has no padding");
+constexpr char MERGED_INDEX_DESCR[] = "[('sample', '<u8'), ('radius', '<f8'), ('record', '<u8'), ('part', '<u4'), "
+	"('cameraHeight', '<f4'), ('cameraInclination', '<f4'), ('fovy', '<f4')]";
+
+// indexes the parts of a dataset generated by `--shard i/N` runs into index.npy, a structured array with a
+// MergedIndexEntry per sample of the sweep in sample order (see dataset.py). Only the shard indices and the tensor
+// labels are read, the images stay where they are. Returns 1, without an index, if a sample is missing or was
+// generated twice.
+int mergeParts(const std::string& datasetPath, const std::string& datasetFormat, size_t nrSamples) {
+	if (datasetFormat != "shards" && datasetFormat != "tensors") {
+		std::cerr << "Only the \"shards\" and \"tensors\" formats store the sample indices needed to merge parts\n";
+		return 1;
+	}
+
+	size_t nrParts = 0;
+	for (auto&& entry : std::filesystem::directory_iterator(datasetPath)) {
+		unsigned long part, parts;
+		std::string name = entry.path().filename().string();
+		if (std::sscanf(name.c_str(), "part-%lu-of-%lu", &part, &parts) == 2 && parts != 0
+				&& name == std::filesystem::path{getPartDirectory("", part, parts)}.filename().string()) {
+			if (nrParts != 0 && parts != nrParts) {
+				std::cerr << "The parts in " << datasetPath << " split the sweep in different numbers of parts\n";
+				return 1;
+			}
+			nrParts = parts;
+		}
+	}
+	if (nrParts == 0) {
+		std::cerr << "No part-i-of-N directories to merge in " << datasetPath << "\n";
+		return 1;
+	}
+
+	const std::string indexPath = datasetPath + "/index.npy";
+	NpyFile index{indexPath, MERGED_INDEX_DESCR, sizeof(MergedIndexEntry), {}, nrSamples};
+	std::vector<bool> seen(nrSamples);
+	size_t nrDuplicates = 0, nrOutside = 0;
+	auto add = [&](const MergedIndexEntry& entry) {
+		if (entry.sample >= nrSamples) {
+			++nrOutside;
+		} else if (seen[entry.sample]) {
+			++nrDuplicates;
+		} else {
+			seen[entry.sample] = true;
+			std::memcpy(index.getRecord(entry.sample), &entry, sizeof(entry));
+		}
+	};
+
+	for (uint32_t part = 0; part != nrParts; ++part) {
+		const std::string directory = getPartDirectory(datasetPath, part, nrParts);
+		if (!std::filesystem::is_directory(directory)) {
+			continue; // its samples are reported missing below
+		}
+		uint64_t record = 0;
+		if (datasetFormat == "shards") {
+			std::vector<std::string> shards;
+			for (auto&& entry : std::filesystem::directory_iterator(directory)) {
+				if (entry.path().extension() == ".shard") {
+					shards.push_back(entry.path().string());
+				}
+			}
+			std::sort(shards.begin(), shards.end());
+			for (auto&& shard : shards) {
+				std::ifstream file{shard, std::ios::binary};
+				DatasetWriter::ShardHeader header;
+				file.read((char*) &header, sizeof(header));
+				if (!file || std::memcmp(header.magic, "SGSHARD", 8) != 0 || header.version != 2
+						|| header.entrySize != sizeof(DatasetWriter::IndexEntry)) {
+					std::cerr << shard << " is not a dataset shard\n";
+					return 1;
+				}
+				std::vector<DatasetWriter::IndexEntry> entries(header.count);
+				file.seekg(header.indexOffset);
+				file.read((char*) entries.data(), entries.size() * sizeof(DatasetWriter::IndexEntry));
+				if (!file) {
+					std::cerr << "The index of " << shard << " is truncated\n";
+					return 1;
+				}
+				for (auto&& entry : entries) {
+					add({entry.sample, entry.radius, record++, part, entry.cameraHeight, entry.cameraInclination, entry.fovy});
+				}
+			}
+		} else {
+			// labels.npy was written by TensorDatasetWriter: records of 5 doubles right after the header
+			std::ifstream file{directory + "/labels.npy", std::ios::binary};
+			char preamble[10];
+			file.read(preamble, sizeof(preamble));
+			if (!file || std::memcmp(preamble, "\x93NUMPY\x01\x00", 8) != 0) {
+				std::cerr << directory << "/labels.npy is missing or not an .npy file\n";
+				return 1;
+			}
+			file.seekg(sizeof(preamble) + (uint8_t) preamble[8] + ((uint8_t) preamble[9] << 8));
+			double labels[5];
+			while (file.read((char*) labels, sizeof(labels))) {
+				add({(uint64_t) labels[4], labels[0], record++, part, (float) labels[1], (float) labels[2], (float) labels[3]});
+			}
+		}
+	}
+
+	size_t nrMissing = std::count(seen.begin(), seen.end(), false);
+	if (nrMissing != 0 || nrDuplicates != 0 || nrOutside != 0) {
+		index.close(0);
+		std::remove(indexPath.c_str());
+		std::cerr << "Cannot merge the " << nrParts << " parts: " << nrMissing << " samples missing (the first is "
+			<< (nrMissing != 0 ? std::find(seen.begin(), seen.end(), false) - seen.begin() : 0) << "), " << nrDuplicates
+			<< " generated twice, " << nrOutside << " outside of the sweep\n";
+		return 1;
+	}
+	index.close(nrSamples);
+	std::cout << "Merged " << nrSamples << " samples of " << nrParts << " parts into " << indexPath << "\n";
+	return 0;
+}
+
+
 class Renderer {
 	private: static void checkShader(int shader, const std::string& name) {
 		int success;
@@ -88,34 +1102,58 @@ class Renderer {
 		return shaderProgram;
 	}
 
-	private: static void genVboVao(
+	private: struct VertexAttrib {
+		std::string name;
+		int size;
+		GLenum type = GL_FLOAT;
+		bool normalized = false; // for integer types: map to [0, 1] instead of converting to float as is
+	};
+
+	private: static int sizeOfType(GLenum type) {
+		switch (type) {
+			case GL_UNSIGNED_BYTE: case GL_BYTE: return 1;
+			case GL_HALF_FLOAT: case GL_UNSIGNED_SHORT: case GL_SHORT: return 2;
+			default: return 4;
+		}
+	}
+
+	private: static void genVao(
 			unsigned int shader,
-			const std::vector<std::pair<std::string, int>>& attribs,
-			unsigned int& vbo,
+			const std::vector<VertexAttrib>& attribs,
+			unsigned int vbo,
 			unsigned int& vao) {
 		glGenVertexArrays(1, &vao); // predisponimi un VAO e salva un identificatore in `vao_id`
-		glGenBuffers(1, &vbo); // predisponimi un VBO e salva un identificatore in `vbo_id`
+		setVertexAttribs(shader, attribs, vbo, vao);
+	}
 
+	private: static void setVertexAttribs(
+			unsigned int shader,
+			const std::vector<VertexAttrib>& attribs,
+			unsigned int vbo,
+			unsigned int vao) {
 		glBindVertexArray(vao); // voglio usare il VAO all'id `vao_id`
 		glBindBuffer(GL_ARRAY_BUFFER, vbo); // voglio usare il VBO all'id `vbo_id`
 
 
-		int totalSize = 0;
+		int stride = 0;
 		for (auto&& attrib : attribs) {
-			totalSize += attrib.second;
+			stride += attrib.size * sizeOfType(attrib.type);
 		}
 
-		int sizeSoFar = 0;
+		int offsetSoFar = 0;
 		for (auto&& attrib : attribs) {
-			int location = glGetAttribLocation(shader, attrib.first.c_str());
-			glVertexAttribPointer(location, attrib.second, GL_FLOAT, GL_FALSE, totalSize * sizeof(float), (void*)(sizeSoFar * sizeof(float)));
+			int location = glGetAttribLocation(shader, attrib.name.c_str());
+			glVertexAttribPointer(location, attrib.size, attrib.type, attrib.normalized, stride, (void*)(size_t)offsetSoFar);
 			glEnableVertexAttribArray(location);
-			sizeSoFar += attrib.second;
+			offsetSoFar += attrib.size * sizeOfType(attrib.type);
 		}
 	}
 
 
-	private: GLFWwindow* getWindow() {
+	private: void createWindow() {
+		#ifdef NO_GLFW
+		throw std::runtime_error("Compiled without GLFW, only the headless backend is available");
+		#else
 		glfwInit();
 		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
 		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
@@ -125,7 +1163,7 @@ class Renderer {
 		#endif
 
 		// glfw window creation
-		GLFWwindow* window = glfwCreateWindow(width, height, "LearnOpenGL", nullptr, nullptr);
+		window = glfwCreateWindow(width, height, "LearnOpenGL", nullptr, nullptr);
 		if (window == nullptr) {
 			throw std::runtime_error("Failed to create GLFW window");
 		}
@@ -135,74 +1173,487 @@ class Renderer {
 		if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
 			throw std::runtime_error("Failed to initialize GLAD");
 		}
-
-		return window;
+		#endif
+	}
+
+	// creates an OpenGL context without any window or display server (e.g. Mesa llvmpipe on CPU-only nodes)
+	private: void createHeadlessContext() {
+		#ifdef NO_EGL
+		throw std::runtime_error("Compiled without EGL, the headless backend is not available");
+		#else
+		eglDisplay = EGL_NO_DISPLAY;
+		#ifdef EGL_PLATFORM_SURFACELESS_MESA
+		auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (getPlatformDisplay != nullptr) {
+			eglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+		}
+		#endif
+		if (eglDisplay == EGL_NO_DISPLAY) {
+			eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		}
+		if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, nullptr, nullptr)) {
+			throw std::runtime_error("Failed to initialize EGL display");
+		}
+
+		// no surface is ever created, so any config able to render OpenGL is fine
+		const EGLint configAttribs[] = {
+			EGL_SURFACE_TYPE, 0,
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			EGL_NONE,
+		};
+		EGLConfig config;
+		EGLint nrConfigs = 0;
+		if (!eglChooseConfig(eglDisplay, configAttribs, &config, 1, &nrConfigs) || nrConfigs == 0) {
+			throw std::runtime_error("Failed to find an EGL config supporting OpenGL");
+		}
+
+		eglBindAPI(EGL_OPENGL_API);
+		const EGLint contextAttribs[] = {
+			EGL_CONTEXT_MAJOR_VERSION, 3,
+			EGL_CONTEXT_MINOR_VERSION, 3,
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+			EGL_NONE,
+		};
+		eglContext = eglCreateContext(eglDisplay, config, EGL_NO_CONTEXT, contextAttribs);
+		if (eglContext == EGL_NO_CONTEXT) {
+			throw std::runtime_error("Failed to create EGL context");
+		}
+		// requires EGL_KHR_surfaceless_context: all drawing goes to the framebuffer object
+		if (!eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext)) {
+			throw std::runtime_error("Failed to make EGL context current (surfaceless contexts not supported?)");
+		}
+
+		if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress)) {
+			throw std::runtime_error("Failed to initialize GLAD");
+		}
+		#endif
+	}
+
+	// offscreen render target (color + depth) every frame is drawn into, both for
+	// screenshots and for the preview, which is then just blitted to the window; the color is a texture so that
+	// the luminance pass can read it, into the single-channel target of grey screenshots
+	private: void genFramebuffer() {
+		glGenFramebuffers(1, &fbo);
+		glGenTextures(1, &colorTexture);
+		glGenRenderbuffers(1, &depthRbo);
+
+		glBindTexture(GL_TEXTURE_2D, colorTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthRbo);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRbo);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			throw std::runtime_error("Offscreen framebuffer is incomplete");
+		}
+
+		glGenFramebuffers(1, &greyFbo);
+		glGenRenderbuffers(1, &greyRbo);
+		glBindRenderbuffer(GL_RENDERBUFFER, greyRbo);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_R8, width, height);
+		glBindFramebuffer(GL_FRAMEBUFFER, greyFbo);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, greyRbo);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			throw std::runtime_error("Grey framebuffer is incomplete");
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glViewport(0, 0, width, height);
+	}
+
+	private: void clear() {
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glClearColor(backgroundColor.r, backgroundColor.g, backgroundColor.b, backgroundColor.a);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // also clear the depth buffer now!
+	}
+
+	// shows the content of the offscreen framebuffer in the window, if there is one
+	private: void present() {
+		GLenum glError = glGetError();
+		if (glError != 0) {
+			std::cout<<"glError: "<<glError<<"\n";
+		}
+
+		#ifndef NO_GLFW
+		if (backend == Backend::window) {
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+			glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+			glfwSwapBuffers(window);
+			glfwPollEvents();
+		}
+		#endif
+	}
+
+	private: void drawVertices() {
+		if (annulusTechnique == AnnulusTechnique::raycast) {
+			drawRaycastAnnuli(); // below everything else, since it does not write depth
+		}
+
+		glEnable(GL_DEPTH_TEST);
+		if (annulusTechnique == AnnulusTechnique::procedural) {
+			drawProceduralAnnuli(); // before the strips, so that their transparent distance lines blend over the street
+		}
+
+		glUseProgram(shader);
+		glBindVertexArray(vao);
+		glMultiDrawArrays(GL_TRIANGLE_STRIP, stripFirsts.data(), stripCounts.data(), stripCounts.size());
+		sceneStream.fence();
+	}
+
+	private: void drawRaycastAnnuli() {
+		if (annuli.size() > MAX_RAYCAST_ANNULI) {
+			throw std::length_error("Too many annuli for the ray-casting shader");
+		}
+
+		glDisable(GL_DEPTH_TEST);
+		glUseProgram(raycastShader);
+		glBindVertexArray(annulusVao);
+		glUniform1i(glGetUniformLocation(raycastShader, "nrAnnuli"), annuli.size());
+		for (size_t i = 0; i != annuli.size(); ++i) {
+			auto&& [annulus, style] = annuli[i];
+			auto uniform = [this, i](const std::string& name) {
+				return glGetUniformLocation(raycastShader, (name + "[" + std::to_string(i) + "]").c_str());
+			};
+
+			// offsets are computed in double, so the shader only needs to work with the few meters around the camera
+			double centerDistance = std::hypot(annulus.x0, annulus.z0);
+			glUniform2f(uniform("centerDirection"), annulus.x0 / centerDistance, annulus.z0 / centerDistance);
+			glUniform1f(uniform("centerDistance"), centerDistance);
+			glUniform2f(uniform("radiusOffsets"), annulus.internalRadius - centerDistance, annulus.externalRadius - centerDistance);
+			glUniform1f(uniform("planeY"), annulus.y0);
+			glUniform1i(uniform("resolution"), annulus.resolution);
+			glUniform4f(uniform("color"), style.color.r, style.color.g, style.color.b, style.color.a);
+			glUniform1i(uniform("dashLength"), style.dashLength);
+			glUniform1i(uniform("dashPeriod"), style.dashPeriod);
+		}
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+	}
+
+	private: void drawProceduralAnnuli() {
+		glUseProgram(annulusShader);
+		glBindVertexArray(annulusVao);
+		for (auto&& [annulus, style] : annuli) {
+			glUniform3f(glGetUniformLocation(annulusShader, "center"), annulus.x0, annulus.y0, annulus.z0);
+			glUniform1f(glGetUniformLocation(annulusShader, "internalRadius"), annulus.internalRadius);
+			glUniform1f(glGetUniformLocation(annulusShader, "externalRadius"), annulus.externalRadius);
+			glUniform1i(glGetUniformLocation(annulusShader, "resolution"), annulus.resolution);
+			glUniform4f(glGetUniformLocation(annulusShader, "color"), style.color.r, style.color.g, style.color.b, style.color.a);
+			glUniform1i(glGetUniformLocation(annulusShader, "dashLength"), style.dashLength);
+			glUniform1i(glGetUniformLocation(annulusShader, "dashPeriod"), style.dashPeriod);
+			glDrawArrays(GL_TRIANGLES, 0, 6 * annulus.resolution);
+		}
+	}
+
+	private: void drawLineVertices() {
+		glDisable(GL_DEPTH_TEST); // no depth testing!
+		glUseProgram(lineShader);
+		glBindVertexArray(lineVao);
+		glDrawArrays(GL_LINES, firstLineVertex, nrLineVertices);
+		lineStream.fence();
+	}
+
+	public: enum class ScreenshotFormat {
+		rgb,
+		grey,    // the luma of the frame, computed on the GPU so that only one byte per pixel is read back
+		palette, // RGB read back, saved as palette indices when the frame has at most 256 colors
+	};
+
+	public: enum class FileFormat {
+		png,
+		qoi, // several times faster to encode and decode than PNG, similar sizes on generated frames; always RGB
+	};
+
+	public: static const char* getFileExtension(FileFormat fileFormat) {
+		return fileFormat == FileFormat::qoi ? ".qoi" : ".png";
+	}
+
+	public: struct ScreenshotSettings {
+		FileFormat fileFormat = FileFormat::png;
+		ScreenshotFormat format = ScreenshotFormat::rgb;
+		int compressionLevel = 1; // 0 writes uncompressed PNGs, 1 (fastest) to 9 (smallest) compress them, see TinyPngOut
+		bool directIo = false;    // write files with O_DIRECT, bypassing the page cache
+	};
+
+	private: static unsigned int getBytesPerPixel(ScreenshotFormat format) {
+		return format == ScreenshotFormat::grey ? 1 : 3;
+	}
+
+	// replaces RGB pixels with indices into a palette of their colors, fails if there are more than 256 colors
+	private: static bool indexColors(const uint8_t* rgb, size_t nrPixels, std::vector<uint8_t>& indices, std::vector<uint8_t>& palette) {
+		constexpr uint32_t noColor = UINT32_MAX; // colors only use 24 bits
+		constexpr int tableBits = 10;            // open addressing, at most 256 of the slots are used
+		std::array<uint32_t, 1 << tableBits> colors;
+		std::array<uint8_t, 1 << tableBits> colorIndices;
+		colors.fill(noColor);
+
+		indices.resize(nrPixels);
+		palette.clear();
+		uint32_t lastColor = noColor;
+		uint8_t lastIndex = 0;
+		for (size_t i = 0; i != indices.size(); ++i) {
+			const uint8_t* pixel = &rgb[3 * i];
+			uint32_t color = pixel[0] << 16 | pixel[1] << 8 | pixel[2];
+			if (color != lastColor) { // flat colors come in runs, most pixels stop here
+				size_t slot = (color * 2654435761u) >> (32 - tableBits);
+				while (colors[slot] != color && colors[slot] != noColor) {
+					slot = (slot + 1) % colors.size();
+				}
+				if (colors[slot] == noColor) {
+					if (palette.size() == 3 * 256) {
+						return false;
+					}
+					colors[slot] = color;
+					colorIndices[slot] = palette.size() / 3;
+					palette.insert(palette.end(), pixel, pixel + 3);
+				}
+				lastColor = color;
+				lastIndex = colorIndices[slot];
+			}
+			indices[i] = lastIndex;
+		}
+		return true;
+	}
+
+	// a frame copied out of its pixel pack buffer, to be encoded and written by the encoder threads
+	private: struct EncodeJob {
+		const uint8_t* source;        // the pixels to save: `pixels`, or the mapped pixel pack buffer when encoding inline
+		std::vector<uint8_t> pixels;  // bottom-up, as read back
+		std::vector<uint8_t> encoded; // the image file, when stored in the dataset shards
+		std::string filename;
+		SampleLabel label;
+		ScreenshotSettings settings;
+	};
+
+	private: static void encodeScreenshot(const uint8_t* bottomUpPixels, unsigned int w, unsigned int h,
+			const ScreenshotSettings& settings, OutputSink& screenshotFile) {
+		// OpenGL returns rows bottom-up, PNG and QOI want them top-down: the rows are fed last to first, without flipping a copy
+		const ptrdiff_t rowSize = getBytesPerPixel(settings.format) * w;
+		const uint8_t* topRow = bottomUpPixels + rowSize * (h-1);
+		const int level = settings.compressionLevel;
+
+		std::vector<uint8_t> indices, palette; // bottom-up like the pixels, the palette has to be known before the first row
+		if (settings.fileFormat == FileFormat::qoi) { // QOI has no palettes, but its index of recent colors plays the same role
+			auto pixelFormat = settings.format == ScreenshotFormat::grey ? QoiOut::PixelFormat::grey : QoiOut::PixelFormat::rgb;
+			QoiOut{w, h, screenshotFile, pixelFormat}.writeRows(topRow, h, -rowSize);
+		} else if (settings.format == ScreenshotFormat::grey) {
+			TinyPngOut{w, h, screenshotFile, level, TinyPngOut::ColorType::grey}.writeRows(topRow, h, -rowSize);
+		} else if (settings.format == ScreenshotFormat::palette && indexColors(bottomUpPixels, (size_t) w * h, indices, palette)) {
+			TinyPngOut{w, h, screenshotFile, level, TinyPngOut::ColorType::palette, palette}
+				.writeRows(indices.data() + (size_t) w * (h-1), h, -(ptrdiff_t) w);
+		} else { // frames with too many colors for a palette are saved as RGB
+			TinyPngOut{w, h, screenshotFile, level}.writeRows(topRow, h, -rowSize);
+		}
+	}
+
+	private: static void writeScreenshot(const uint8_t* bottomUpPixels, unsigned int w, unsigned int h,
+			const ScreenshotSettings& settings, const std::string& filename) {
+		// the whole file is collected in a user-space buffer and written with a few large syscalls; consecutive frames
+		// may have the same name and be written by different encoder threads at once, so each thread writes its own
+		// temporary file and renames it, which also leaves no truncated image behind if the program is stopped
+		std::ostringstream partialName;
+		partialName << filename << "." << std::this_thread::get_id() << ".part";
+		FdSink screenshotFile{partialName.str(), settings.directIo};
+		encodeScreenshot(bottomUpPixels, w, h, settings, screenshotFile);
+		screenshotFile.close();
+		std::filesystem::rename(partialName.str(), filename);
+	}
+
+	// stores the frame of the job in the tensors, or encodes it in the dataset shards or in its own file
+	private: void saveScreenshot(EncodeJob& job) const {
+		if (tensorDataset != nullptr) {
+			tensorDataset->append(job.source, job.label);
+			return;
+		}
+		if (dataset == nullptr) {
+			writeScreenshot(job.source, width, height, job.settings, job.filename);
+			return;
+		}
+		job.encoded.clear();
+		{
+			VectorSink sink{job.encoded};
+			encodeScreenshot(job.source, width, height, job.settings, sink);
+		}
+		dataset->append(job.encoded.data(), job.encoded.size(), job.label);
 	}
 
-	private: void swapBuffers() {
-		GLenum glError = glGetError();
-		if (glError != 0) {
-			std::cout<<"glError: "<<glError<<"\n";
-		}
+	private: struct PendingReadback {
+		unsigned int pbo;
+		GLsync fence = nullptr;
+		std::string filename;
+		SampleLabel label;
+		ScreenshotSettings settings;
+	};
 
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+	// starts an asynchronous readback of the current frame into the next pixel pack buffer of the ring
+	private: void queueScreenshot(const std::string& filename, const SampleLabel& label) {
+		PendingReadback& slot = readbackRing[nextReadback];
+		if (slot.fence != nullptr) {
+			finishReadback(slot); // the ring is full, the oldest frame has to be written first
+		}
 
-		glClearColor(backgroundColor.r, backgroundColor.g, backgroundColor.b, backgroundColor.a);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // also clear the depth buffer now!
-	}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		readPixels(screenshotSettings.format, nullptr); // returns immediately
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 
-	private: void drawVertices() {
-		glEnable(GL_DEPTH_TEST);
-		glUseProgram(shader);
-		glBindVertexArray(vao);
-		glDrawArrays(GL_TRIANGLES, 0, nrVertices);
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		slot.filename = filename;
+		slot.label = label;
+		slot.settings = screenshotSettings;
+		nextReadback = (nextReadback + 1) % readbackRing.size();
 	}
 
-	private: void drawLineVertices() {
-		glDisable(GL_DEPTH_TEST); // no depth testing!
-		glUseProgram(lineShader);
-		glBindVertexArray(lineVao);
-		glDrawArrays(GL_LINES, 0, nrLineVertices);
+	// reads the current frame into `destination`, or into the bound pixel pack buffer with nullptr: 3 bytes per pixel,
+	// or 1 for ScreenshotFormat::grey, whose luma is first drawn into the grey framebuffer
+	private: void readPixels(ScreenshotFormat format, void* destination) {
+		if (format == ScreenshotFormat::grey) {
+			glBindFramebuffer(GL_FRAMEBUFFER, greyFbo);
+			glDisable(GL_BLEND);
+			glDisable(GL_DEPTH_TEST);
+			glUseProgram(luminanceShader);
+			glBindTexture(GL_TEXTURE_2D, colorTexture);
+			glBindVertexArray(annulusVao);
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+			glEnable(GL_BLEND);
+			glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		}
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, format == ScreenshotFormat::grey ? greyFbo : fbo);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1); // rows of 3*w (or w) bytes are not necessarily 4-aligned
+		glReadPixels(0, 0, width, height, format == ScreenshotFormat::grey ? GL_RED : GL_RGB, GL_UNSIGNED_BYTE, destination);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
 	}
 
-	private: void saveScreenshot(int x, int y, unsigned int w, unsigned int h, const std::string& filename) {
-		std::vector<uint8_t> pixels(3 * w * h);
-		glReadPixels(x, y, w, h, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
-
-		for(int line = 0; line != h/2; ++line) {
-			std::swap_ranges(	pixels.begin() + 3 * w * line,
-									pixels.begin() + 3 * w * (line+1),
-									pixels.begin() + 3 * w * (h-line-1));
+	// waits for the readback in the slot to complete (measuring the stall) and hands it to the encoder threads
+	private: void finishReadback(PendingReadback& slot) {
+		auto waitStart = std::chrono::steady_clock::now();
+		GLenum waitResult;
+		do {
+			waitResult = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		} while (waitResult == GL_TIMEOUT_EXPIRED);
+		readbackStallTime += std::chrono::steady_clock::now() - waitStart;
+		glDeleteSync(slot.fence);
+		slot.fence = nullptr;
+		if (waitResult == GL_WAIT_FAILED) {
+			throw std::runtime_error("Waiting for pixel readback failed");
 		}
 
-		std::ofstream screenshotFile{filename, std::ios::binary};
-		TinyPngOut{w, h, screenshotFile}.write(pixels.data(), w * h);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		auto pixels = (const uint8_t*) glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, getBytesPerPixel(slot.settings.format) * width * height, GL_MAP_READ_BIT);
+		if (pixels == nullptr) {
+			throw std::runtime_error("Failed to map pixel pack buffer");
+		}
+		// without encoder threads the job runs inside submit() and encodes straight from the mapping. Encoder
+		// threads get a copy instead, into the buffer of an already encoded frame: only the GL thread can unmap
+		// the buffer, and keeping it mapped until a worker is done would need a ring as deep as the queue and
+		// persistent mappings, which need OpenGL 4.4 while only 3.3 is requested (see StreamingBuffer). That
+		// costs a memcpy of the frame, far shorter than encoding it, and up to queue size + threads frames of memory
+		EncodeJob job;
+		encoders.reuse(job);
+		if (encoders.getNrThreads() == 0) {
+			job.source = pixels;
+		} else {
+			job.pixels.assign(pixels, pixels + getBytesPerPixel(slot.settings.format) * width * height);
+			job.source = job.pixels.data();
+		}
+		job.filename = slot.filename;
+		job.label = slot.label;
+		job.settings = slot.settings;
+		encoders.submit(job); // blocks if the encoders are behind by more than the queue size
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		++nrReadbacks;
 	}
 
 
-	GLFWwindow* window;
-	unsigned int shader, lineShader;
-	unsigned int vbo, vao, lineVbo, lineVao;
+	public: enum class Backend {
+		window,   // GLFW window, needs a display server
+		headless, // EGL surfaceless context rendering into an FBO
+	};
+
+	private:
+	#ifndef NO_GLFW
+	GLFWwindow* window = nullptr;
+	#endif
+	#ifndef NO_EGL
+	EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+	EGLContext eglContext = EGL_NO_CONTEXT;
+	#endif
+	unsigned int fbo, colorTexture, depthRbo, greyFbo, greyRbo;
+	public: enum class AnnulusTechnique {
+		procedural, // triangles generated in the vertex shader
+		raycast,    // computed exactly per pixel in the fragment shader
+	};
+
+	private:
+	unsigned int shader, lineShader, annulusShader, raycastShader, luminanceShader;
+	unsigned int vao, lineVao, annulusVao;
+	StreamingBuffer sceneStream, lineStream;
+	const std::vector<VertexAttrib> sceneAttribs{{"pos", 3}, {"col", 4, GL_UNSIGNED_BYTE, true}};
+	const std::vector<VertexAttrib> lineAttribs{{"pos", 2}, {"col", 4}};
 
 	const unsigned int width, height;
 	const float screenRatio;
+	const Backend backend;
 	Color backgroundColor;
-	size_t nrVertices, nrLineVertices;
-
+	ScreenshotSettings screenshotSettings;
+
+	std::vector<PendingReadback> readbackRing;
+	size_t nextReadback;
+	size_t nrReadbacks;
+	std::chrono::duration<double> readbackStallTime;
+	WorkerPool<EncodeJob> encoders;
+	DatasetWriter* dataset;
+	TensorDatasetWriter* tensorDataset;
+	std::vector<GLint> stripFirsts;
+	std::vector<GLsizei> stripCounts;
+	size_t firstLineVertex, nrLineVertices;
+	std::vector<std::pair<Annulus, AnnulusStyle>> annuli; // generated on the GPU
+	AnnulusTechnique annulusTechnique;
+	static constexpr size_t MAX_RAYCAST_ANNULI = 8; // MAX_ANNULI in raycast_fragment_shader.glsl
+
+
+	// `readbackRingSize` screenshots can be in flight on the GPU while the next frames are being drawn, and up to
+	// `encoderQueueSize` more waiting for one of the `encoderThreads` to write them (0 threads: written in the render loop)
+	public: Renderer(unsigned int w, unsigned int h, Backend b = Backend::window, size_t readbackRingSize = 3,
+			size_t encoderThreads = 0, size_t encoderQueueSize = 8)
+			: width{w}, height{h}, screenRatio{(float) w / h}, backend{b},
+				readbackRing(std::max(readbackRingSize, (size_t)1)), nextReadback{0}, nrReadbacks{0},
+				readbackStallTime{0}, encoders{encoderThreads, encoderQueueSize, [this](EncodeJob& job) {
+					saveScreenshot(job);
+				}}, dataset{nullptr}, tensorDataset{nullptr}, firstLineVertex{0}, nrLineVertices{0}, annulusTechnique{AnnulusTechnique::procedural} {
+
+		if (backend == Backend::headless) {
+			createHeadlessContext();
+		} else {
+			createWindow();
+		}
+		genFramebuffer();
 
-	public: Renderer(unsigned int w, unsigned int h)
-			: width{w}, height{h}, screenRatio{(float) w / h},
-				nrVertices{0}, nrLineVertices{0} {
+		for (auto&& slot : readbackRing) {
+			glGenBuffers(1, &slot.pbo);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+			glBufferData(GL_PIXEL_PACK_BUFFER, 3 * width * height, nullptr, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 
-		window = getWindow();
 		shader = compileShader("vertex_shader.glsl", "fragment_shader.glsl");
 		lineShader = compileShader("line_vertex_shader.glsl", "line_fragment_shader.glsl");
+		annulusShader = compileShader("annulus_vertex_shader.glsl", "fragment_shader.glsl");
+		raycastShader = compileShader("raycast_vertex_shader.glsl", "raycast_fragment_shader.glsl");
+		luminanceShader = compileShader("raycast_vertex_shader.glsl", "luminance_fragment_shader.glsl"); // full-screen triangle
 
-		genVboVao(shader, {{"pos", 3}, {"col", 4}}, vbo, vao);
-		genVboVao(shader, {{"pos", 2}, {"col", 4}}, lineVbo, lineVao);
+		sceneStream.init(3, sizeof(PackedVertex));
+		lineStream.init(3, 6 * sizeof(float));
+		genVao(shader, sceneAttribs, sceneStream.getBuffer(), vao);
+		genVao(shader, lineAttribs, lineStream.getBuffer(), lineVao);
+		glGenVertexArrays(1, &annulusVao); // no attributes, but the core profile requires a VAO to draw (also used for ray-casting)
 
 		//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+		glProvokingVertex(GL_FIRST_VERTEX_CONVENTION); // flat colors come from the first vertex of each triangle
 		glEnable(GL_BLEND); // transparency
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	}
@@ -210,118 +1661,566 @@ class Renderer {
 	public: ~Renderer() {
 		glDeleteVertexArrays(1, &vao);
 		glDeleteVertexArrays(1, &lineVao);
-		glDeleteBuffers(1, &vbo);
-		glDeleteBuffers(1, &lineVbo);
-		glfwTerminate();
+		glDeleteVertexArrays(1, &annulusVao);
+		sceneStream.release();
+		lineStream.release();
+		for (auto&& slot : readbackRing) {
+			if (slot.fence != nullptr) {
+				glDeleteSync(slot.fence);
+			}
+			glDeleteBuffers(1, &slot.pbo);
+		}
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteTextures(1, &colorTexture);
+		glDeleteRenderbuffers(1, &depthRbo);
+		glDeleteFramebuffers(1, &greyFbo);
+		glDeleteRenderbuffers(1, &greyRbo);
+
+		#ifndef NO_EGL
+		if (eglDisplay != EGL_NO_DISPLAY) {
+			eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+			eglDestroyContext(eglDisplay, eglContext);
+			eglTerminate(eglDisplay);
+		}
+		#endif
+		#ifndef NO_GLFW
+		if (backend == Backend::window) {
+			glfwTerminate();
+		}
+		#endif
 	}
 
 
-	public: void setCameraParams(float cameraInclination, float fovy) {
-		float screenRatio = (float)width / (float)height;
-		int viewUniformLocation = glGetUniformLocation(shader, "view");
-		int projectionUniformLocation = glGetUniformLocation(shader, "projection");
-
-		glUseProgram(shader);
-		glBindVertexArray(vao);
+	public: void setCameraParams(const Camera& camera) {
+		float screenRatio = (float)camera.width / (float)camera.height;
 
 		// make sure to initialize matrix to identity matrix first
 		glm::mat4 view{1.0f};
 		//view = glm::translate(view, glm::vec3{0,0,0});
 		//view = glm::rotate(view, glm::radians(0.0f), glm::vec3{0,    1.0f, 0}); // yaw
-		view = glm::rotate(view, cameraInclination, glm::vec3{1.0f, 0,    0}); // pitch
-		glUniformMatrix4fv(viewUniformLocation, 1, GL_FALSE, &view[0][0]);
+		view = glm::rotate(view, camera.inclination, glm::vec3{1.0f, 0,    0}); // pitch
 
 		glm::mat4 projection = glm::mat4(1.0f);
-		projection = glm::perspective(fovy, screenRatio, 0.01f, 100.0f);
-		glUniformMatrix4fv(projectionUniformLocation, 1, GL_FALSE, &projection[0][0]);
+		projection = glm::perspective(camera.fovy, screenRatio, camera.near, camera.far);
+
+		for (unsigned int program : {shader, annulusShader}) {
+			glUseProgram(program);
+			glUniformMatrix4fv(glGetUniformLocation(program, "view"), 1, GL_FALSE, &view[0][0]);
+			glUniformMatrix4fv(glGetUniformLocation(program, "projection"), 1, GL_FALSE, &projection[0][0]);
+		}
+
+		glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+		glUseProgram(raycastShader);
+		glUniformMatrix4fv(glGetUniformLocation(raycastShader, "inverseViewProjection"), 1, GL_FALSE, &inverseViewProjection[0][0]);
+		glUniformMatrix4fv(glGetUniformLocation(raycastShader, "view"), 1, GL_FALSE, &view[0][0]);
+		glUniform2f(glGetUniformLocation(raycastShader, "screenSize"), width, height);
+		glUniform1f(glGetUniformLocation(raycastShader, "far"), camera.far);
 	}
 
-	public: void loadVertices(const std::vector<float>& vertices) {
-		glBindVertexArray(vao);
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STREAM_DRAW);
-		nrVertices = vertices.size();
+	// the vertices form triangle strips, each starting at firsts[i] and long counts[i] vertices
+	public: void loadVertices(const std::vector<PackedVertex>& vertices, const std::vector<GLint>& firsts, const std::vector<GLsizei>& counts) {
+		bool reallocated;
+		size_t firstVertex = sceneStream.write(vertices.data(), vertices.size() * sizeof(PackedVertex), reallocated);
+		if (reallocated) {
+			setVertexAttribs(shader, sceneAttribs, sceneStream.getBuffer(), vao);
+		}
+
+		stripFirsts.resize(firsts.size());
+		std::transform(firsts.begin(), firsts.end(), stripFirsts.begin(), [firstVertex](GLint first) { return first + firstVertex; });
+		stripCounts = counts;
 	}
 
 	public: void loadLineVertices(const std::vector<float>& vertices) {
-		glBindVertexArray(lineVao);
-		glBindBuffer(GL_ARRAY_BUFFER, lineVbo);
-		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STREAM_DRAW);
-		nrLineVertices = vertices.size();
+		bool reallocated;
+		firstLineVertex = lineStream.write(vertices.data(), vertices.size() * sizeof(float), reallocated);
+		if (reallocated) {
+			setVertexAttribs(shader, lineAttribs, lineStream.getBuffer(), lineVao);
+		}
+		nrLineVertices = vertices.size() / 6;
+	}
+
+	// the annuli are generated entirely on the GPU: changing them costs just some uniforms
+	public: void loadAnnuli(const std::vector<Annulus>& streetAnnuli, const AnnulusStyle& streetStyle, const AnnulusStyle& lineStyle) {
+		annuli.clear();
+		for (auto&& annulus : streetAnnuli) {
+			annuli.emplace_back(annulus, annulus.isLine ? lineStyle : streetStyle);
+		}
+	}
+
+	public: void setAnnulusTechnique(AnnulusTechnique technique) {
+		annulusTechnique = technique;
 	}
 
 	public: void setBackgroundColor(const Color& color) {
 		backgroundColor = color;
 	}
 
+	public: void setScreenshotSettings(const ScreenshotSettings& settings) {
+		screenshotSettings = settings;
+	}
+
+	// screenshots are then appended to the shards of the dataset, instead of being written to their own files
+	public: void setDataset(DatasetWriter* datasetWriter) {
+		dataset = datasetWriter;
+	}
+
+	// screenshots are then copied raw into the tensors, with the same pixel format as read back
+	public: void setTensorDataset(TensorDatasetWriter* tensorDatasetWriter) {
+		tensorDataset = tensorDatasetWriter;
+	}
+
 
 	public: void draw() {
+		clear();
 		drawVertices();
 		drawLineVertices();
-		swapBuffers();
+		present();
 	}
 
 	public: bool shouldClose() {
-		return glfwWindowShouldClose(window);
+		#ifndef NO_GLFW
+		if (backend == Backend::window) {
+			return glfwWindowShouldClose(window);
+		}
+		#endif
+		return false; // headless rendering stops only when the caller decides so
 	}
 
-	public: void screenshot(const std::string& filename) {
+	// draws the frame exactly once, queues it to be saved and then shows it in the preview window (if any);
+	// the file is written only a few screenshots later, or when calling flushScreenshots(); with a dataset the label
+	// is stored in its index, and the filename is not used
+	public: void screenshot(const std::string& filename, const SampleLabel& label = {}) {
+		clear();
 		drawVertices();
-		swapBuffers();
+		queueScreenshot(filename, label);
+		present();
+	}
+
+	// draws the frame and reads it back right away as bottom-up rows, stalling until the GPU is done: for checks,
+	// datasets go through screenshot()
+	public: std::vector<uint8_t> readFrame(ScreenshotFormat format = ScreenshotFormat::rgb) {
+		clear();
 		drawVertices();
-		saveScreenshot(0, 0, width, height, filename);
+		std::vector<uint8_t> pixels((size_t) width * height * getBytesPerPixel(format));
+		readPixels(format, pixels.data());
+		return pixels;
+	}
+
+	// writes all screenshots still in flight and prints how long the CPU had to wait for the GPU and the encoders
+	public: void flushScreenshots() {
+		for (size_t i = 0; i != readbackRing.size(); ++i) {
+			PendingReadback& slot = readbackRing[(nextReadback + i) % readbackRing.size()];
+			if (slot.fence != nullptr) {
+				finishReadback(slot);
+			}
+		}
+		encoders.wait();
+
+		if (nrReadbacks != 0) {
+			std::cout << "Readback: " << nrReadbacks << " frames, ring size " << readbackRing.size()
+				<< ", stalled " << readbackStallTime.count() * 1000 << "ms in total ("
+				<< readbackStallTime.count() * 1000 / nrReadbacks << "ms per frame)\n";
+			std::cout << "Encoding: " << encoders.getNrThreads() << " threads, queue size " << encoders.getQueueSize()
+				<< ", " << encoders.getProcessTime().count() * 1000 / nrReadbacks << "ms per frame, renderer blocked "
+				<< encoders.getBlockedTime().count() * 1000 << "ms in total\n";
+		}
 	}
 };
 
 
-std::vector<float> getAnnulus(float x0, float y0, float z0, float internalRadius, float externalRadius, int resolution,
-		const std::function<Color()>& colorGenerator) {
-	std::vector<float> triangles;
-	triangles.reserve(6*resolution);
+// single contiguous vertex buffer the whole scene is written into, made of triangle strips (drawn with flat
+// colors taken from the first vertex of each triangle); clear() keeps the allocated memory, so after the first
+// frame no reallocation nor copy happens anymore
+class SceneBuilder {
+	private: std::vector<PackedVertex> vertices;
+	private: std::vector<GLint> stripFirsts;
+	private: std::vector<GLsizei> stripCounts;
+	private: size_t bytesGenerated = 0, bytesCopied = 0; // since the last clear()
+	private: size_t totalBytesGenerated = 0, totalBytesCopied = 0, nrFrames = 0;
+
+	public: void reserve(size_t nrVertices) {
+		if (nrVertices > vertices.capacity()) {
+			bytesCopied += vertices.size() * sizeof(PackedVertex);
+			vertices.reserve(std::max(nrVertices, 2 * vertices.capacity())); // amortized growth, like push_back
+		}
+	}
+
+	// starts a new triangle strip and returns where to write its `nrVertices` vertices
+	public: PackedVertex* addStrip(size_t nrVertices) {
+		reserve(getNrVertices() + nrVertices);
+		size_t size = vertices.size();
+		vertices.resize(size + nrVertices);
+		stripFirsts.push_back(size);
+		stripCounts.push_back(nrVertices);
+		bytesGenerated += nrVertices * sizeof(PackedVertex) + sizeof(GLint) + sizeof(GLsizei);
+		return vertices.data() + size;
+	}
 
-	auto angle = [&resolution](int v) {
-		return 2 * M_PI * v / resolution;
-	};
-	auto addPoint = [&triangles, &x0, &y0, &z0, &colorGenerator](float radius, float angle) {
-		triangles.push_back(x0 + radius*cos(angle));
-		triangles.push_back(y0);
-		triangles.push_back(z0 + radius*sin(angle));
-
-		auto [r,g,b,a] = colorGenerator();
-		triangles.push_back(r);
-		triangles.push_back(g);
-		triangles.push_back(b);
-		triangles.push_back(a);
-	};
+	public: void clear() {
+		totalBytesGenerated += bytesGenerated;
+		totalBytesCopied += bytesCopied;
+		++nrFrames;
+		bytesGenerated = bytesCopied = 0;
+		vertices.clear();
+		stripFirsts.clear();
+		stripCounts.clear();
+	}
+
+	public: const std::vector<PackedVertex>& getVertices() const {
+		return vertices;
+	}
+
+	public: const std::vector<GLint>& getStripFirsts() const {
+		return stripFirsts;
+	}
+
+	public: const std::vector<GLsizei>& getStripCounts() const {
+		return stripCounts;
+	}
 
-	for(int v = 0; v != resolution; ++v) {
-		float a1 = angle(v);
-		float a2 = angle(v+1);
+	public: size_t getNrVertices() const {
+		return vertices.size();
+	}
 
-		// first triangle
-		addPoint(internalRadius, a1);
-		addPoint(internalRadius, a2);
-		addPoint(externalRadius, a1);
+	public: void printReport() const {
+		size_t frames = std::max(nrFrames, (size_t)1);
+		std::cout << "Scene: " << totalBytesGenerated / frames / 1024 << "KiB generated and "
+			<< totalBytesCopied / frames / 1024 << "KiB copied per frame on average ("
+			<< nrFrames << " frames)\n";
+	}
+};
 
-		// second triangle
-		addPoint(internalRadius, a2);
-		addPoint(externalRadius, a1);
-		addPoint(externalRadius, a2);
+// Unit circle kernels: they fill cosines[i] and sines[i] with the cosine and sine of startAngle + step*i for
+// i in [0, n), rotating the previous point by `step` instead of calling cos/sin for every point. The exact
+// values are recomputed every UNIT_CIRCLE_RESEED points, so that the rounding errors do not accumulate.
+constexpr int UNIT_CIRCLE_RESEED = 256;
+
+void getUnitCircleScalar(double startAngle, double step, int n, double* cosines, double* sines) {
+	double cosStep = cos(step), sinStep = sin(step);
+	for (int i = 0; i < n; ++i) {
+		if (i % UNIT_CIRCLE_RESEED == 0) {
+			cosines[i] = cos(startAngle + step*i);
+			sines[i] = sin(startAngle + step*i);
+		} else {
+			cosines[i] = cosines[i-1]*cosStep - sines[i-1]*sinStep;
+			sines[i] = sines[i-1]*cosStep + cosines[i-1]*sinStep;
+		}
 	}
+}
 
-	return triangles;
+#if defined(__x86_64__) && defined(__GNUC__)
+// 4 points at a time, every lane rotated by 4*step
+__attribute__((target("avx2,fma")))
+void getUnitCircleAvx2(double startAngle, double step, int n, double* cosines, double* sines) {
+	const __m256d cosStep4 = _mm256_set1_pd(cos(4*step)), sinStep4 = _mm256_set1_pd(sin(4*step));
+	int i = 0;
+	__m256d c = _mm256_setzero_pd(), s = _mm256_setzero_pd();
+	for (; i + 4 <= n; i += 4) {
+		if (i % UNIT_CIRCLE_RESEED == 0) {
+			double a = startAngle + step*i;
+			c = _mm256_setr_pd(cos(a), cos(a + step), cos(a + 2*step), cos(a + 3*step));
+			s = _mm256_setr_pd(sin(a), sin(a + step), sin(a + 2*step), sin(a + 3*step));
+		} else {
+			__m256d rotatedC = _mm256_fmsub_pd(c, cosStep4, _mm256_mul_pd(s, sinStep4));
+			s = _mm256_fmadd_pd(s, cosStep4, _mm256_mul_pd(c, sinStep4));
+			c = rotatedC;
+		}
+		_mm256_storeu_pd(cosines + i, c);
+		_mm256_storeu_pd(sines + i, s);
+	}
+	for (; i < n; ++i) {
+		cosines[i] = cos(startAngle + step*i);
+		sines[i] = sin(startAngle + step*i);
+	}
+}
+#endif
+
+#if defined(__aarch64__)
+// 2 points at a time, every lane rotated by 2*step
+void getUnitCircleNeon(double startAngle, double step, int n, double* cosines, double* sines) {
+	const float64x2_t cosStep2 = vdupq_n_f64(cos(2*step)), sinStep2 = vdupq_n_f64(sin(2*step));
+	int i = 0;
+	float64x2_t c = vdupq_n_f64(0), s = vdupq_n_f64(0);
+	for (; i + 2 <= n; i += 2) {
+		if (i % UNIT_CIRCLE_RESEED == 0) {
+			double a = startAngle + step*i;
+			double initialC[] = {cos(a), cos(a + step)}, initialS[] = {sin(a), sin(a + step)};
+			c = vld1q_f64(initialC);
+			s = vld1q_f64(initialS);
+		} else {
+			float64x2_t rotatedC = vfmsq_f64(vmulq_f64(c, cosStep2), s, sinStep2);
+			s = vfmaq_f64(vmulq_f64(s, cosStep2), c, sinStep2);
+			c = rotatedC;
+		}
+		vst1q_f64(cosines + i, c);
+		vst1q_f64(sines + i, s);
+	}
+	for (; i < n; ++i) {
+		cosines[i] = cos(startAngle + step*i);
+		sines[i] = sin(startAngle + step*i);
+	}
+}
+#endif
+
+void getUnitCircle(double startAngle, double step, int n, double* cosines, double* sines) {
+	#if defined(__aarch64__)
+	getUnitCircleNeon(startAngle, step, n, cosines, sines);
+	#elif defined(__x86_64__) && defined(__GNUC__)
+	static const bool hasAvx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	if (hasAvx2) {
+		getUnitCircleAvx2(startAngle, step, n, cosines, sines);
+	} else {
+		getUnitCircleScalar(startAngle, step, n, cosines, sines);
+	}
+	#else
+	getUnitCircleScalar(startAngle, step, n, cosines, sines);
+	#endif
 }
 
-std::vector<float> getLine(float x0, float y0, float z0, float x1, float y1, float z1, float thickness, const Color& color) {
-	auto [r, g, b, a] = color;
-	return {
-		x0 - thickness, y0 - thickness, z0 - thickness, r, g, b, a,
-		x0 + thickness, y0 + thickness, z0 + thickness, r, g, b, a,
-		x1 + thickness, y1 + thickness, z1 + thickness, r, g, b, a,
-		x1 + thickness, y1 + thickness, z1 + thickness, r, g, b, a,
-		x1 - thickness, y1 - thickness, z1 - thickness, r, g, b, a,
-		x0 - thickness, y0 - thickness, z0 - thickness, r, g, b, a,
+// Arc packing kernels: for every point i in [0, n) of the unit circle they write the strip vertices 2i and 2i+1 on the
+// internal and external circle, copying y and the color from `colored`. Multiplications and additions are kept
+// separate, so that every kernel rounds exactly like the scalar one.
+
+void packArcScalar(const double* cosines, const double* sines, int n, double x0, double z0, double internalRadius,
+		double externalRadius, const PackedVertex& colored, PackedVertex* out) {
+	for (int i = 0; i < n; ++i) {
+		out[2*i] = colored;
+		out[2*i].x = (float) (x0 + internalRadius*cosines[i]);
+		out[2*i].z = (float) (z0 + internalRadius*sines[i]);
+		out[2*i + 1] = colored;
+		out[2*i + 1].x = (float) (x0 + externalRadius*cosines[i]);
+		out[2*i + 1].z = (float) (z0 + externalRadius*sines[i]);
+	}
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// 4 points (8 vertices) at a time: the coordinates are interleaved with y and the color by unpacking
+__attribute__((target("avx2")))
+void packArcAvx2(const double* cosines, const double* sines, int n, double x0, double z0, double internalRadius,
+		double externalRadius, const PackedVertex& colored, PackedVertex* out) {
+	const __m256d x04 = _mm256_set1_pd(x0), z04 = _mm256_set1_pd(z0);
+	const __m256d internal4 = _mm256_set1_pd(internalRadius), external4 = _mm256_set1_pd(externalRadius);
+	uint32_t rgba;
+	std::memcpy(&rgba, &colored.r, sizeof(rgba));
+	const __m128 y4 = _mm_set1_ps(colored.y), rgba4 = _mm_castsi128_ps(_mm_set1_epi32((int) rgba));
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d c = _mm256_loadu_pd(cosines + i), s = _mm256_loadu_pd(sines + i);
+		__m128 internalX = _mm256_cvtpd_ps(_mm256_add_pd(x04, _mm256_mul_pd(internal4, c)));
+		__m128 internalZ = _mm256_cvtpd_ps(_mm256_add_pd(z04, _mm256_mul_pd(internal4, s)));
+		__m128 externalX = _mm256_cvtpd_ps(_mm256_add_pd(x04, _mm256_mul_pd(external4, c)));
+		__m128 externalZ = _mm256_cvtpd_ps(_mm256_add_pd(z04, _mm256_mul_pd(external4, s)));
+		// (x0, y, x1, y) and (z0, rgba, z1, rgba) give the vertices (x0, y, z0, rgba) and (x1, y, z1, rgba)
+		__m128 internalXY01 = _mm_unpacklo_ps(internalX, y4), internalZC01 = _mm_unpacklo_ps(internalZ, rgba4);
+		__m128 internalXY23 = _mm_unpackhi_ps(internalX, y4), internalZC23 = _mm_unpackhi_ps(internalZ, rgba4);
+		__m128 externalXY01 = _mm_unpacklo_ps(externalX, y4), externalZC01 = _mm_unpacklo_ps(externalZ, rgba4);
+		__m128 externalXY23 = _mm_unpackhi_ps(externalX, y4), externalZC23 = _mm_unpackhi_ps(externalZ, rgba4);
+		__m128 internal0 = _mm_movelh_ps(internalXY01, internalZC01), external0 = _mm_movelh_ps(externalXY01, externalZC01);
+		__m128 internal1 = _mm_movehl_ps(internalZC01, internalXY01), external1 = _mm_movehl_ps(externalZC01, externalXY01);
+		__m128 internal2 = _mm_movelh_ps(internalXY23, internalZC23), external2 = _mm_movelh_ps(externalXY23, externalZC23);
+		__m128 internal3 = _mm_movehl_ps(internalZC23, internalXY23), external3 = _mm_movehl_ps(externalZC23, externalXY23);
+		float* points = (float*) &out[2*i]; // the internal and the external vertex of a point take 8 floats
+		_mm256_storeu_ps(points, _mm256_set_m128(external0, internal0));
+		_mm256_storeu_ps(points + 8, _mm256_set_m128(external1, internal1));
+		_mm256_storeu_ps(points + 16, _mm256_set_m128(external2, internal2));
+		_mm256_storeu_ps(points + 24, _mm256_set_m128(external3, internal3));
+	}
+	packArcScalar(cosines + i, sines + i, n - i, x0, z0, internalRadius, externalRadius, colored, out + 2*i);
+}
+#endif
+
+#if defined(__aarch64__)
+// 2 points (4 vertices) at a time: vst4q_f32 interleaves x, y, z and the color of the 4 vertices
+void packArcNeon(const double* cosines, const double* sines, int n, double x0, double z0, double internalRadius,
+		double externalRadius, const PackedVertex& colored, PackedVertex* out) {
+	const float64x2_t x02 = vdupq_n_f64(x0), z02 = vdupq_n_f64(z0);
+	const float64x2_t internal2 = vdupq_n_f64(internalRadius), external2 = vdupq_n_f64(externalRadius);
+	uint32_t rgba;
+	std::memcpy(&rgba, &colored.r, sizeof(rgba));
+	float32x4x4_t vertices;
+	vertices.val[1] = vdupq_n_f32(colored.y);
+	vertices.val[3] = vreinterpretq_f32_u32(vdupq_n_u32(rgba));
+	int i = 0;
+	for (; i + 2 <= n; i += 2) {
+		float64x2_t c = vld1q_f64(cosines + i), s = vld1q_f64(sines + i);
+		float32x2_t internalX = vcvt_f32_f64(vaddq_f64(x02, vmulq_f64(internal2, c)));
+		float32x2_t internalZ = vcvt_f32_f64(vaddq_f64(z02, vmulq_f64(internal2, s)));
+		float32x2_t externalX = vcvt_f32_f64(vaddq_f64(x02, vmulq_f64(external2, c)));
+		float32x2_t externalZ = vcvt_f32_f64(vaddq_f64(z02, vmulq_f64(external2, s)));
+		// (internal 0, external 0, internal 1, external 1), the order of the strip
+		vertices.val[0] = vcombine_f32(vzip1_f32(internalX, externalX), vzip2_f32(internalX, externalX));
+		vertices.val[2] = vcombine_f32(vzip1_f32(internalZ, externalZ), vzip2_f32(internalZ, externalZ));
+		vst4q_f32((float*) &out[2*i], vertices);
+	}
+	packArcScalar(cosines + i, sines + i, n - i, x0, z0, internalRadius, externalRadius, colored, out + 2*i);
+}
+#endif
+
+void packArc(const double* cosines, const double* sines, int n, double x0, double z0, double internalRadius,
+		double externalRadius, const PackedVertex& colored, PackedVertex* out) {
+	#if defined(__aarch64__)
+	packArcNeon(cosines, sines, n, x0, z0, internalRadius, externalRadius, colored, out);
+	#elif defined(__x86_64__) && defined(__GNUC__)
+	static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+	if (hasAvx2) {
+		packArcAvx2(cosines, sines, n, x0, z0, internalRadius, externalRadius, colored, out);
+	} else {
+		packArcScalar(cosines, sines, n, x0, z0, internalRadius, externalRadius, colored, out);
+	}
+	#else
+	packArcScalar(cosines, sines, n, x0, z0, internalRadius, externalRadius, colored, out);
+	#endif
+}
+
+// tessellates the part of the annulus between the two angles (in radians) with `resolution` segments; `colors` is a
+// color policy (see ConstantColor), called with the index of the segment and of the triangle in it and with the angle
+// of the middle of the segment. If the colors change every so many segments per turn, the arc is widened to whole
+// ones of those and each of them is split in the same number of segments, so that the colors change on vertices
+template <typename ColorPolicy>
+void addArc(SceneBuilder& scene, double x0, double y0, double z0, double internalRadius, double externalRadius,
+		double startAngle, double endAngle, int resolution, const ColorPolicy& colors) {
+	if (resolution <= 0) {
+		return;
+	}
+	if (int segmentsPerTurn = colors.getSegmentsPerTurn(); segmentsPerTurn > 0) {
+		double segmentsPerRadian = segmentsPerTurn / (2 * M_PI);
+		int first = (int) std::floor(startAngle * segmentsPerRadian);
+		int count = std::max(1, (int) std::ceil(endAngle * segmentsPerRadian) - first);
+		startAngle = first / segmentsPerRadian;
+		endAngle = (first + count) / segmentsPerRadian;
+		resolution = count * ((resolution + count - 1) / count);
+	}
+
+	// the points on the two circles are computed only once, even if every one of them is used by 3 vertices
+	thread_local std::vector<double> cosines, sines;
+	cosines.resize(resolution + 1);
+	sines.resize(resolution + 1);
+	double step = (endAngle - startAngle) / resolution;
+	getUnitCircle(startAngle, step, resolution + 1, cosines.data(), sines.data());
+
+	// strip alternating internal and external points: triangle 2v starts from the internal point v and
+	// triangle 2v+1 from the external one, so both take the color of segment v
+	PackedVertex* out = scene.addStrip(2 * (resolution + 1));
+	float y = y0;
+	if constexpr (ColorPolicy::isConstant) {
+		// the color is converted once and the vertices are packed by a SIMD kernel
+		PackedVertex colored{0, y, 0, colors(0, 0, 0)};
+		packArc(cosines.data(), sines.data(), resolution + 1, x0, z0, internalRadius, externalRadius, colored, out);
+		return;
+	}
+	for(int v = 0; v <= resolution; ++v) {
+		int segment = std::min(v, resolution - 1); // the last points start no triangle, their color is unused
+		double angle = startAngle + (segment + 0.5) * step;
+		out[2*v] = {(float) (x0 + internalRadius*cosines[v]), y, (float) (z0 + internalRadius*sines[v]), colors(segment, 0, angle)};
+		out[2*v + 1] = {(float) (x0 + externalRadius*cosines[v]), y, (float) (z0 + externalRadius*sines[v]), colors(segment, 1, angle)};
+	}
+}
+
+template <typename ColorPolicy>
+void addAnnulus(SceneBuilder& scene, float x0, float y0, float z0, float internalRadius, float externalRadius, int resolution,
+		const ColorPolicy& colors) {
+	addArc(scene, x0, y0, z0, internalRadius, externalRadius, 0, 2 * M_PI, resolution, colors);
+}
+
+// returns the smallest angular interval of the annulus containing everything the camera can see of it,
+// tessellated finely enough that no segment deviates more than `maxErrorPixels` from the real circle on
+// the screen; `resolution` is 0 if the annulus is not visible at all
+Arc getVisibleArc(const Annulus& annulus, const Camera& camera, float maxErrorPixels) {
+	// frustum corners in world space (in double, the center of the annulus can be kilometers away);
+	// the camera is in the origin looking towards -z, pitched down by the inclination
+	double tanY = tan(camera.fovy / 2), tanX = tanY * camera.width / camera.height;
+	double cosI = cos(camera.inclination), sinI = sin(camera.inclination);
+	std::array<glm::dvec3, 8> corners;
+	for (int i = 0; i != 8; ++i) {
+		double depth = (i & 4) ? camera.far : camera.near;
+		double x = (i & 1 ? 1 : -1) * tanX * depth, y = (i & 2 ? 1 : -1) * tanY * depth, z = -depth;
+		corners[i] = {x, y * cosI + z * sinI, z * cosI - y * sinI}; // inverse of the view rotation
+	}
+
+	// the part of the plane of the annulus inside the frustum is the convex hull of the points where the
+	// frustum edges cross the plane
+	std::vector<glm::dvec2> footprint;
+	for (int i = 0; i != 8; ++i) {
+		for (int bit : {1, 2, 4}) {
+			if (i & bit) {
+				continue;
+			}
+			glm::dvec3 p = corners[i], q = corners[i | bit];
+			if ((p.y - annulus.y0) * (q.y - annulus.y0) <= 0 && p.y != q.y) {
+				double t = (annulus.y0 - p.y) / (q.y - p.y);
+				footprint.push_back({p.x + t * (q.x - p.x), p.z + t * (q.z - p.z)});
+			}
+		}
+	}
+	if (footprint.empty()) {
+		return {0, 0, 0};
+	}
+
+	// the footprint is convex, so sorting its points around their centroid gives its hull in counterclockwise order
+	glm::dvec2 centroid{0, 0};
+	for (auto&& point : footprint) {
+		centroid += point / (double)footprint.size();
+	}
+	std::sort(footprint.begin(), footprint.end(), [&centroid](glm::dvec2 a, glm::dvec2 b) {
+		return atan2(a.y - centroid.y, a.x - centroid.x) < atan2(b.y - centroid.y, b.x - centroid.x);
+	});
+
+	// distances of the footprint from the center of the annulus and from the camera: 0 for a point inside the
+	// footprint, otherwise the distance to its nearest hull edge
+	auto footprintDistance = [&footprint](glm::dvec2 point) {
+		double distance = INFINITY;
+		bool inside = footprint.size() >= 3;
+		for (size_t i = 0; i != footprint.size(); ++i) {
+			glm::dvec2 p = footprint[i], pq = footprint[(i + 1) % footprint.size()] - p;
+			double t = glm::dot(pq, pq) == 0 ? 0 : std::clamp(glm::dot(point - p, pq) / glm::dot(pq, pq), 0.0, 1.0);
+			distance = std::min(distance, glm::length(p + t * pq - point));
+			inside &= pq.x * (point.y - p.y) - pq.y * (point.x - p.x) >= 0; // on the left of every edge
+		}
+		return inside ? 0 : distance;
 	};
+	glm::dvec2 center{annulus.x0, annulus.z0};
+	double minCenterDistance = footprintDistance(center), minCameraDistance = footprintDistance({0, 0});
+	double maxCenterDistance = 0;
+	for (auto&& point : footprint) {
+		maxCenterDistance = std::max(maxCenterDistance, glm::length(point - center));
+	}
+	double internalRadius = std::min(annulus.internalRadius, annulus.externalRadius);
+	double externalRadius = std::max(annulus.internalRadius, annulus.externalRadius);
+	if (maxCenterDistance < internalRadius || minCenterDistance > externalRadius) {
+		return {0, 0, 0};
+	}
+
+	// angles subtended by the footprint as seen from the center, relative to the direction of its centroid;
+	// if they span half a turn or more the footprint surrounds the center and the whole annulus may be visible
+	double referenceAngle = atan2(centroid.y - center.y, centroid.x - center.x);
+	double minAngle = INFINITY, maxAngle = -INFINITY;
+	for (auto&& point : footprint) {
+		glm::dvec2 d = point - center;
+		double angle = atan2(d.y * cos(referenceAngle) - d.x * sin(referenceAngle), d.x * cos(referenceAngle) + d.y * sin(referenceAngle));
+		minAngle = std::min(minAngle, angle);
+		maxAngle = std::max(maxAngle, angle);
+	}
+	double startAngle = 0, endAngle = 2 * M_PI;
+	if (maxAngle - minAngle < M_PI) {
+		startAngle = referenceAngle + minAngle;
+		endAngle = referenceAngle + maxAngle;
+	}
+
+	// a chord spanning `step` radians is at most r*step^2/8 away from the circle, and that is seen
+	// (at worst from the nearest visible point) as `focal` pixels per meter at distance 1
+	double focal = camera.height / 2.0 / tanY;
+	double nearestDistance = std::hypot(minCameraDistance, annulus.y0);
+	double step = sqrt(8 * maxErrorPixels * nearestDistance / (focal * externalRadius));
+	int resolution = (int) std::clamp(std::ceil((endAngle - startAngle) / step), 1.0, (double) annulus.resolution);
+	return {startAngle, endAngle, resolution};
+}
+
+void addLine(SceneBuilder& scene, float x0, float y0, float z0, float x1, float y1, float z1, float thickness, const Color& color) {
+	PackedVertex* out = scene.addStrip(4);
+	out[0] = {x0 - thickness, y0 - thickness, z0 - thickness, color};
+	out[1] = {x0 + thickness, y0 + thickness, z0 + thickness, color};
+	out[2] = {x1 - thickness, y1 - thickness, z1 - thickness, color};
+	out[3] = {x1 + thickness, y1 + thickness, z1 + thickness, color};
 }
 
 std::vector<float> getProjLines(float screenRatio, float cameraInclination, float fovy, const Color& color) {
@@ -340,41 +2239,94 @@ std::vector<float> getProjLines(float screenRatio, float cameraInclination, floa
 }
 
 
-std::vector<float> merge(const std::initializer_list<std::vector<float>>& vectors) {
-	std::vector<float> result;
+// counter-based random numbers, Philox4x32-10 of Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3" (SC11):
+// every value is a pure function of the global seed (the key) and of a counter made of the sample index, the stream
+// and the position of the value in the stream, so any sample can be regenerated alone, by any thread or machine,
+// without sharing nor advancing a generator state
+enum class RandomStream : uint32_t {
+	streetParam, // the parameter of the street, when drawn at random
+	noiseGrey,   // the colors of NoiseGrey triangles
+};
+
+struct RandomKey {
+	uint64_t seed;
+	uint64_t sample;
+	RandomStream stream;
 
-	for (auto&& v : vectors) {
-		result.insert(result.end(), v.begin(), v.end());
+	// 128 random bits for the value at `position` in the stream
+	constexpr std::array<uint32_t, 4> bits(uint64_t position) const {
+		return philox({(uint32_t) sample, (uint32_t) (sample >> 32), (uint32_t) stream, (uint32_t) position},
+			{(uint32_t) seed, (uint32_t) (seed >> 32)});
 	}
 
-	return result;
-}
+	// uniform in [0, 1), with 53 random bits
+	constexpr double uniform(uint64_t position) const {
+		auto [a, b, c, d] = bits(position);
+		return ((uint64_t) a << 21 ^ b >> 11) * 0x1.0p-53;
+	}
 
-float randomReal() {
-	static std::random_device rd;
-	static std::mt19937 engine(rd());
-	static std::uniform_real_distribution<> dist(0, 1);
-	return dist(engine);
-}
+	static constexpr std::array<uint32_t, 4> philox(std::array<uint32_t, 4> counter, std::array<uint32_t, 2> key) {
+		for (int round = 0; round != 10; ++round) {
+			uint64_t product0 = (uint64_t) 0xD2511F53u * counter[0], product1 = (uint64_t) 0xCD9E8D57u * counter[2];
+			counter = {
+				(uint32_t) (product1 >> 32) ^ counter[1] ^ key[0], (uint32_t) product1,
+				(uint32_t) (product0 >> 32) ^ counter[3] ^ key[1], (uint32_t) product0,
+			};
+			key = {key[0] + 0x9E3779B9u, key[1] + 0xBB67AE85u}; // Weyl sequence of the golden ratio and sqrt(3)-1
+		}
+		return counter;
+	}
+};
 
 constexpr Color white() { return {1.0f,1.0f,1.0f}; }
 constexpr Color grey() { return {0.05f,0.05f,0.05f}; }
 constexpr Color invisible() { return {0.0f,0.0f,0.0f,0.0f}; }
 
-Color alternatingWhite() {
-	static int counter = 0;
-	++counter;
+// Color policies: they return the color of a triangle given the index of its segment in the arc, its index (0 or 1)
+// in the segment and the angle of the middle of the segment, so the result does not depend on the order of the calls
+// and the compiler can inline them. getSegmentsPerTurn() is how finely arcs must be tessellated to show the colors,
+// 0 if any tessellation will do, and isConstant tells addArc() that every triangle gets the same color
 
-	if ((counter/15)%7 < 4) {
-		return white();
-	} else {
-		return invisible();
+struct ConstantColor {
+	static constexpr bool isConstant = true;
+	Color color;
+	constexpr Color operator()(int, int, double) const { return color; }
+	constexpr int getSegmentsPerTurn() const { return 0; }
+};
+
+// `dashLength` visible segments every `dashPeriod` segments, continuous if the period is 0 (as in AnnulusStyle). The
+// segments are the ones of the whole annulus cut in `segmentsPerTurn` from angle 0, not the ones of the arc, so that
+// the dashes stay still in the world whatever part of the annulus the camera sees and however finely it is tessellated
+struct DashedColor {
+	static constexpr bool isConstant = false;
+	Color color;
+	int dashLength, dashPeriod, segmentsPerTurn;
+	Color operator()(int, int, double angle) const {
+		if (dashPeriod == 0) {
+			return color;
+		}
+		int segment = (int) std::floor((angle / (2 * M_PI) - std::floor(angle / (2 * M_PI))) * segmentsPerTurn);
+		return std::min(segment, segmentsPerTurn - 1) % dashPeriod >= dashLength ? invisible() : color;
 	}
-}
+	constexpr int getSegmentsPerTurn() const { return dashPeriod == 0 ? 0 : segmentsPerTurn; }
+};
+
+// every triangle gets a grey between 0 and `maxGrey`, which depends only on the key and on the indices
+struct NoiseGrey {
+	static constexpr bool isConstant = false;
+	RandomKey key;
+	float maxGrey;
+	constexpr Color operator()(int segment, int triangle, double) const {
+		float grey = (key.bits(2 * (uint64_t) segment + triangle)[0] >> 8) * (maxGrey / (1u << 24));
+		return {grey, grey, grey};
+	}
+	constexpr int getSegmentsPerTurn() const { return 0; }
+};
 
-Color randomGrey() {
-	float grey = randomReal()/10;
-	return Color{grey,grey,grey};
+// dashes of 10 segments of a street annulus (getStreetAnnuli() tessellates them with 10000) every 18
+constexpr DashedColor alternatingWhite() { return {white(), 10, 18, 10000}; }
+constexpr NoiseGrey randomGrey(uint64_t seed, uint64_t sample, float maxGrey = 0.1f) {
+	return {{seed, sample, RandomStream::noiseGrey}, maxGrey};
 }
 
 
@@ -395,39 +2347,566 @@ std::vector<float> getForwardStreetToInfinity(float cameraInclination, float fov
 	};
 }
 
-// returns the direction of the street (-1 for left, 1 for right), the diameter of the street in millimeters, and the vertices
-auto getStreet(double param, float cameraHeight, const std::function<Color()>& streetColor, const std::function<Color()>& lineColor) {
-	int paramSign = (param < 0 ? -1 : 1);
+// the radius in meters of the street with the given parameter, whose sign is the direction of the street
+double getStreetRadius(double param) {
 	param = std::pow(std::min(std::max(std::abs(param), 0.01), 1.0), 2);
-	double d = 10 * tan(M_PI_2 - param * M_PI_2);
+	return 10 * tan(M_PI_2 - param * M_PI_2);
+}
+
+// the inverse of getStreetRadius(), negative for negative radiuses (turning left)
+double getStreetParam(double radius) {
+	return (radius < 0 ? -1 : 1) * std::sqrt(1 - atan(std::abs(radius) / 10) / M_PI_2);
+}
+
+// returns the direction of the street (-1 for left, 1 for right), the diameter of the street in millimeters, and the annuli
+auto getStreetAnnuli(double param, float cameraHeight) {
+	int paramSign = (param < 0 ? -1 : 1);
+	double d = getStreetRadius(param);
 
-	std::vector<float> streets, v0, v1, v2;
+	std::vector<Annulus> annuli;
 	if (paramSign == -1) {
-		streets = getAnnulus(-d,     -cameraHeight, 0, d-5.0, d+2.0, 10000, streetColor);
-		v0 =      getAnnulus(-d, .002-cameraHeight, 0, d-4.6, d-4.4, 10000, lineColor);
-		v1 =      getAnnulus(-d, .002-cameraHeight, 0, d-1.6, d-1.4, 10000, lineColor);
-		v2 =      getAnnulus(-d, .002-cameraHeight, 0, d+1.4, d+1.6, 10000, lineColor);
+		annuli = {
+			{-d,     -cameraHeight, 0, d-5.0, d+2.0, 10000, false},
+			{-d, .002-cameraHeight, 0, d-4.6, d-4.4, 10000, true},
+			{-d, .002-cameraHeight, 0, d-1.6, d-1.4, 10000, true},
+			{-d, .002-cameraHeight, 0, d+1.4, d+1.6, 10000, true},
+		};
 
 	} else {
-		streets = getAnnulus(d,     -cameraHeight, 0, d+5.0, d-2.0, 10000, streetColor);
-		v0 =      getAnnulus(d, .002-cameraHeight, 0, d+4.6, d+4.4, 10000, lineColor);
-		v1 =      getAnnulus(d, .002-cameraHeight, 0, d+1.6, d+1.4, 10000, lineColor);
-		v2 =      getAnnulus(d, .002-cameraHeight, 0, d-1.4, d-1.6, 10000, lineColor);
+		annuli = {
+			{d,     -cameraHeight, 0, d+5.0, d-2.0, 10000, false},
+			{d, .002-cameraHeight, 0, d+4.6, d+4.4, 10000, true},
+			{d, .002-cameraHeight, 0, d+1.6, d+1.4, 10000, true},
+			{d, .002-cameraHeight, 0, d-1.4, d-1.6, 10000, true},
+		};
+	}
+
+	return std::tuple{paramSign, (int)(d*1000), annuli};
+}
+
+// adds the street to the scene and returns its direction (-1 for left, 1 for right) and its diameter in millimeters;
+// only the arcs visible by the camera are tessellated, unless `maxErrorPixels` is not positive
+template <typename StreetColorPolicy, typename LineColorPolicy>
+auto addStreet(SceneBuilder& scene, double param, float cameraHeight, const StreetColorPolicy& streetColor,
+		const LineColorPolicy& lineColor, const Camera& camera, float maxErrorPixels) {
+	auto [paramSign, d, annuli] = getStreetAnnuli(param, cameraHeight);
+
+	for (auto&& annulus : annuli) {
+		auto&& [x0, y0, z0, internalRadius, externalRadius, resolution, isLine] = annulus;
+		Arc arc{0, 2 * M_PI, resolution};
+		if (maxErrorPixels > 0) {
+			arc = getVisibleArc(annulus, camera, maxErrorPixels);
+		}
+
+		if (isLine) {
+			addArc(scene, x0, y0, z0, internalRadius, externalRadius, arc.startAngle, arc.endAngle, arc.resolution, lineColor);
+		} else {
+			addArc(scene, x0, y0, z0, internalRadius, externalRadius, arc.startAngle, arc.endAngle, arc.resolution, streetColor);
+		}
 	}
 
-	return std::tuple{paramSign, (int)(d*1000), merge({streets,v0,v1,v2})};
+	return std::tuple{paramSign, d};
 }
 
-std::vector<float> getDistLines(float length, float y, int count) {
-	std::vector<float> res;
+void addDistLines(SceneBuilder& scene, float length, float y, int count) {
 	for(int i = 0; i != count; ++i) {
-		res = merge({res, getLine(-length, y, -i, length, y, -i, 0.01, {i%2, i%4, i%8, .8})});
+		addLine(scene, -length, y, -i, length, y, -i, 0.01, {(float)(i%2), (float)(i%4), (float)(i%8), .8});
+	}
+}
+
+
+// one sample of the dataset: the street and the camera looking at it
+struct SampleJob {
+	uint64_t sample;         // index in the sweep, also the sample of its RandomKeys
+	double streetParam;      // as taken by getStreetAnnuli(), negative when the street turns left
+	float cameraHeight;      // meters
+	float cameraInclination; // radians
+	float streetNoise;       // maximum grey of the street surface drawn by randomGrey(), 0 for a constant grey
+};
+
+// the samples of a dataset as a deterministic list of jobs, each depending only on its index (and on the seed), so
+// that a dataset does not depend on the frame rate and can be regenerated exactly. The "sweep" object of params.json
+// tells how the streets are chosen, with radiuses between `minRadius` and `maxRadius` meters on both sides:
+//   "grid"        `samples` evenly spaced street parameters (see getStreetRadius())
+//   "uniform"     `samples` street parameters drawn at random
+//   "stratified"  `samples` spread evenly over `strata` ranges of street parameters on each side, drawn at random in
+//                 each range, so that every range of radiuses gets the same number of samples
+//   "explicit"    the `jobs` list, e.g. [{"radius": -25, "cameraHeight": 1.1, "cameraInclination": 12}], where the
+//                 camera defaults to the global params and the inclination is in degrees
+// With `streetNoise` > 0 (also per explicit job) every triangle of the street gets a random grey up to that value.
+class Sweep {
+	public: enum class Mode { grid, uniform, stratified, list };
+
+	private: Mode mode;
+	private: size_t nrSamples, nrStrata;
+	private: double minParam, maxParam; // absolute values
+	private: uint64_t seed;
+	private: float cameraHeight, cameraInclination, streetNoise;
+	private: std::vector<SampleJob> jobs;
+
+	public: Sweep(const json& spec, uint64_t randomSeed, float defaultCameraHeight, float defaultCameraInclination)
+			: seed{randomSeed}, cameraHeight{defaultCameraHeight}, cameraInclination{defaultCameraInclination} {
+		std::string modeName = spec.value("mode", "uniform");
+		mode = modeName == "grid" ? Mode::grid : modeName == "uniform" ? Mode::uniform
+			: modeName == "stratified" ? Mode::stratified : Mode::list;
+		if (mode == Mode::list && modeName != "explicit") {
+			throw std::invalid_argument("Unknown sweep mode " + modeName);
+		}
+
+		// the defaults are the range that the clock-driven sweep used to cover, sin(time)/1.5
+		double minRadius = spec.value("minRadius", getStreetRadius(1 / 1.5));
+		double maxRadius = spec.value("maxRadius", getStreetRadius(0));
+		if (!(0 < minRadius && minRadius <= maxRadius)) {
+			throw std::invalid_argument("The sweep needs 0 < minRadius <= maxRadius");
+		}
+		minParam = std::max(getStreetParam(maxRadius), 0.01);
+		maxParam = std::max(getStreetParam(minRadius), minParam);
+		nrStrata = 2 * std::max(spec.value("strata", (size_t) 50), (size_t) 1);
+		streetNoise = spec.value("streetNoise", 0.0f);
+
+		if (mode == Mode::list) {
+			for (auto&& job : spec.at("jobs")) {
+				jobs.push_back({jobs.size(), getStreetParam(job.at("radius")), job.value("cameraHeight", cameraHeight),
+					job.contains("cameraInclination") ? glm::radians((float) job["cameraInclination"]) : cameraInclination,
+					job.value("streetNoise", streetNoise)});
+			}
+			nrSamples = jobs.size();
+		} else {
+			nrSamples = spec.value("samples", (size_t) 10000);
+		}
+	}
+
+	public: size_t getNrSamples() const {
+		return nrSamples;
+	}
+
+	// whether some job draws a noisy street
+	public: bool hasStreetNoise() const {
+		return streetNoise > 0 || std::any_of(jobs.begin(), jobs.end(), [](const SampleJob& job) { return job.streetNoise > 0; });
+	}
+
+	// whether every job looks through the default camera
+	public: bool hasFixedCamera() const {
+		return std::all_of(jobs.begin(), jobs.end(), [this](const SampleJob& job) {
+			return job.cameraHeight == cameraHeight && job.cameraInclination == cameraInclination;
+		});
+	}
+
+	public: SampleJob getJob(uint64_t sample) const {
+		if (mode == Mode::list) {
+			return jobs.at(sample);
+		}
+
+		double u; // in [0, 1), mapped to the parameters from the tightest left turn to the tightest right turn
+		RandomKey key{seed, sample, RandomStream::streetParam};
+		if (mode == Mode::grid) {
+			u = (sample + 0.5) / nrSamples;
+		} else if (mode == Mode::uniform) {
+			u = key.uniform(0);
+		} else {
+			u = (sample % nrStrata + key.uniform(0)) / nrStrata;
+		}
+		double t = 2 * u - 1;
+		return {sample, (t < 0 ? -1 : 1) * (minParam + std::abs(t) * (maxParam - minParam)), cameraHeight, cameraInclination,
+			streetNoise};
+	}
+};
+
+
+// returns the average duration in seconds of a call to `function`
+template <typename F>
+double timeIt(int repetitions, F&& function) {
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i != repetitions; ++i) {
+		function();
+	}
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / repetitions;
+}
+
+// micro-benchmarks of the hot spots of the generator, run with `./a.out --benchmark`
+int runBenchmarks() {
+	constexpr int resolution = 10000, repetitions = 50;
+	constexpr double d = 1000.0;
+	std::cout << "Annulus generation, " << resolution << " segments:\n";
+
+	// what getAnnulus() used to do: cos/sin in double for every vertex, and a push_back for every float
+	std::vector<float> reference;
+	double referenceTime = timeIt(repetitions, [&]() {
+		reference.clear();
+		reference.reserve(6*7*resolution);
+		auto addPoint = [&reference](float radius, float angle) {
+			reference.push_back(d + radius*cos(angle));
+			reference.push_back(-1.0f);
+			reference.push_back(0 + radius*sin(angle));
+			auto [r,g,b,a] = white();
+			reference.insert(reference.end(), {r, g, b, a});
+		};
+		for(int v = 0; v != resolution; ++v) {
+			float a1 = 2 * M_PI * v / resolution, a2 = 2 * M_PI * (v+1) / resolution;
+			addPoint(d-5, a1); addPoint(d-5, a2); addPoint(d+5, a1);
+			addPoint(d-5, a2); addPoint(d+5, a1); addPoint(d+5, a2);
+		}
+	});
+
+	SceneBuilder scene;
+	double kernelTime = timeIt(repetitions, [&]() {
+		scene.clear();
+		addAnnulus(scene, d, -1.0f, 0, d-5, d+5, resolution, ConstantColor{white()});
+	});
+
+	// the strip has the internal and external points of segment v where the triangles had vertices 6v and 6v+2
+	double maxDifference = 0;
+	for (int v = 0; v != resolution; ++v) {
+		for (int i : {0, 1}) {
+			const float* expected = &reference[7 * (6*v + 2*i)];
+			const PackedVertex& actual = scene.getVertices()[2*v + i];
+			maxDifference = std::max({maxDifference, (double) std::abs(expected[0] - actual.x), (double) std::abs(expected[2] - actual.z)});
+		}
 	}
-	return res;
+
+	double nrSegments = resolution;
+	std::cout << "  per-vertex cos/sin + push_back: " << nrSegments / referenceTime / 1e6 << " Msegments/s, "
+		<< reference.size() * sizeof(float) / nrSegments << " bytes/segment\n"
+		<< "  unit circle kernel, packed strip: " << nrSegments / kernelTime / 1e6 << " Msegments/s ("
+		<< referenceTime / kernelTime << "x), " << scene.getNrVertices() * sizeof(PackedVertex) / nrSegments
+		<< " bytes/segment, max difference " << maxDifference << "m\n";
+
+	// a road-like RGB frame: flat grey background with a few white stripes and some blocky noise, like NoiseGrey triangles
+	constexpr unsigned frameWidth = 1280, frameHeight = 720;
+	std::vector<uint8_t> frame(frameWidth * frameHeight * 3);
+	for (unsigned y = 0; y != frameHeight; ++y) {
+		for (unsigned x = 0; x != frameWidth; ++x) {
+			bool stripe = y > frameHeight/2 && (x + y/4) % 160 < 8;
+			uint8_t value = stripe ? 255 : 90 + (x/32*7 + y/8*13) % 5;
+			std::fill_n(&frame[3 * (y*frameWidth + x)], 3, value);
+		}
+	}
+	std::cout << "PNG of a " << frameWidth << "x" << frameHeight << " frame (" << frame.size() / 1024 << "KiB):\n";
+
+	uint32_t referenceCrc = 0;
+	double bitwiseTime = timeIt(5, [&]() {
+		uint32_t c = ~0u;
+		for (uint8_t byte : frame) {
+			c ^= byte;
+			for (int i = 0; i != 8; ++i) {
+				c = (c >> 1) ^ (0xEDB88320u & -(c & 1));
+			}
+		}
+		referenceCrc = ~c;
+	});
+	uint32_t crc = 0;
+	double crcTime = timeIt(repetitions, [&]() {
+		crc = TinyPngOut::updateCrc32(0, frame.data(), frame.size());
+	});
+	uint32_t referenceAdler = 1;
+	double perByteModuloTime = timeIt(5, [&]() {
+		uint32_t s1 = 1, s2 = 0;
+		for (uint8_t byte : frame) {
+			s1 = (s1 + byte) % 65521;
+			s2 = (s2 + s1) % 65521;
+		}
+		referenceAdler = s2 << 16 | s1;
+	});
+	uint32_t adler = 1;
+	double adlerTime = timeIt(repetitions, [&]() {
+		adler = TinyPngOut::updateAdler32(1, frame.data(), frame.size());
+	});
+
+	double megabytes = frame.size() / 1e6;
+	std::cout << "  bitwise CRC-32: " << megabytes / bitwiseTime << " MB/s\n"
+		<< "  TinyPngOut CRC-32: " << megabytes / crcTime << " MB/s (" << bitwiseTime / crcTime << "x), "
+		<< (crc == referenceCrc ? "matches" : "DOES NOT MATCH") << " the bitwise result\n"
+		<< "  per-byte modulo Adler-32: " << megabytes / perByteModuloTime << " MB/s\n"
+		<< "  TinyPngOut Adler-32: " << megabytes / adlerTime << " MB/s (" << perByteModuloTime / adlerTime << "x), "
+		<< (adler == referenceAdler ? "matches" : "DOES NOT MATCH") << " the per-byte result\n";
+
+	for (int level : {0, 1, 2, 4, 6, 9}) {
+		std::ostringstream png;
+		double encodeTime = timeIt(5, [&]() {
+			png.str("");
+			TinyPngOut writer{frameWidth, frameHeight, png, level};
+			writer.write(frame.data(), frameWidth * frameHeight);
+		});
+		std::cout << "  encode at level " << level << ": " << encodeTime * 1000 << "ms, " << png.str().size() / 1024
+			<< "KiB (" << (double) frame.size() / png.str().size() << "x smaller)\n";
+	}
+
+	// stored blocks are the worst case for small writes: a 5-byte header every 64KiB and a filter byte every line
+	const std::string benchmarkFile = "benchmark.png";
+	double ofstreamTime = timeIt(5, [&]() {
+		std::ofstream file{benchmarkFile, std::ios::binary};
+		TinyPngOut{frameWidth, frameHeight, file}.write(frame.data(), frameWidth * frameHeight);
+	});
+	std::cout << "  level 0 to a file: std::ofstream " << ofstreamTime * 1000 << "ms";
+	for (bool directIo : {false, true}) {
+		bool direct = false;
+		double sinkTime = timeIt(5, [&]() {
+			FdSink file{benchmarkFile, directIo};
+			direct = file.isDirect();
+			TinyPngOut{frameWidth, frameHeight, file}.write(frame.data(), frameWidth * frameHeight);
+			file.close();
+		});
+		std::cout << ", FdSink" << (direct ? " with O_DIRECT " : " ") << sinkTime * 1000 << "ms";
+	}
+	std::cout << "\n";
+	std::remove(benchmarkFile.c_str());
+
+	// the frame is monochrome, so a single channel (as read back for ScreenshotFormat::grey) holds all of it
+	std::vector<uint8_t> greyFrame(frameWidth * frameHeight);
+	for (size_t i = 0; i != greyFrame.size(); ++i) {
+		greyFrame[i] = frame[3 * i];
+	}
+	for (auto colorType : {TinyPngOut::ColorType::grey, TinyPngOut::ColorType::palette}) {
+		bool palette = colorType == TinyPngOut::ColorType::palette;
+		std::vector<uint8_t> greys(3 * 256);
+		for (size_t i = 0; i != greys.size(); ++i) {
+			greys[i] = i / 3;
+		}
+		std::ostringstream png;
+		double encodeTime = timeIt(5, [&]() {
+			png.str("");
+			TinyPngOut writer{frameWidth, frameHeight, png, 1, colorType, palette ? greys : std::vector<uint8_t>{}};
+			writer.write(greyFrame.data(), frameWidth * frameHeight);
+		});
+		std::cout << "  encode " << (palette ? "palette" : "grey") << " at level 1: " << encodeTime * 1000 << "ms, "
+			<< png.str().size() / 1024 << "KiB\n";
+	}
+
+	// QOI trades some size for an encoder (and decoder) without any search nor entropy coding
+	for (auto pixelFormat : {QoiOut::PixelFormat::rgb, QoiOut::PixelFormat::grey}) {
+		bool grey = pixelFormat == QoiOut::PixelFormat::grey;
+		std::ostringstream qoi;
+		double encodeTime = timeIt(5, [&]() {
+			qoi.str("");
+			OstreamSink sink{qoi};
+			QoiOut{frameWidth, frameHeight, sink, pixelFormat}.write(grey ? greyFrame.data() : frame.data(), frameWidth * frameHeight);
+		});
+		std::cout << "  encode QOI" << (grey ? " from grey" : "") << ": " << encodeTime * 1000 << "ms, "
+			<< qoi.str().size() / 1024 << "KiB (" << (double) frame.size() / qoi.str().size() << "x smaller)\n";
+	}
+
+	// frames handed to the encoder threads like Renderer::finishReadback() does, the producer only copies the pixels
+	constexpr int nrFrames = 32;
+	unsigned int maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	for (unsigned int nrThreads : {0u, 1u, maxThreads}) {
+		std::vector<size_t> sizes(nrFrames);
+		double poolTime = timeIt(1, [&]() {
+			WorkerPool<std::pair<std::vector<uint8_t>, int>> pool{nrThreads, 8, [&](std::pair<std::vector<uint8_t>, int>& job) {
+				std::ostringstream png;
+				TinyPngOut{frameWidth, frameHeight, png, 1}.write(job.first.data(), frameWidth * frameHeight);
+				sizes[job.second] = png.str().size();
+			}};
+			for (int i = 0; i != nrFrames; ++i) {
+				std::pair<std::vector<uint8_t>, int> job;
+				pool.reuse(job);
+				job.first.assign(frame.begin(), frame.end());
+				job.second = i;
+				pool.submit(job);
+			}
+			pool.wait();
+		});
+		bool allEncoded = std::all_of(sizes.begin(), sizes.end(), [&](size_t size) { return size == sizes[0] && size > 0; });
+		std::cout << "  " << nrFrames << " frames at level 1 with " << nrThreads << " encoder threads: "
+			<< nrFrames / poolTime << " frames/s" << (allEncoded ? "" : ", SOME FRAMES WERE NOT ENCODED") << "\n";
+		if (maxThreads == 1 && nrThreads == 1) {
+			break;
+		}
+	}
+
+	// known answers of the Random123 reference implementation, then the cost of a value against a shared mt19937
+	bool philoxMatches = RandomKey::philox({0, 0, 0, 0}, {0, 0}) == std::array<uint32_t, 4>{0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}
+		&& RandomKey::philox({~0u, ~0u, ~0u, ~0u}, {~0u, ~0u}) == std::array<uint32_t, 4>{0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}
+		&& RandomKey::philox({0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}, {0xa4093822, 0x299f31d0})
+			== std::array<uint32_t, 4>{0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1};
+	constexpr int nrValues = 1 << 22;
+	double sum = 0;
+	std::mt19937 engine{0};
+	std::uniform_real_distribution<> distribution{0, 1};
+	double mersenneTime = timeIt(5, [&]() {
+		for (int i = 0; i != nrValues; ++i) {
+			sum += distribution(engine);
+		}
+	});
+	double philoxTime = timeIt(5, [&]() {
+		for (int i = 0; i != nrValues; ++i) {
+			sum += RandomKey{0, (uint64_t) i, RandomStream::noiseGrey}.uniform(0);
+		}
+	});
+	std::cout << "Random numbers: mt19937 " << nrValues / mersenneTime / 1e6 << "M/s, Philox4x32-10 "
+		<< nrValues / philoxTime / 1e6 << "M/s, " << (philoxMatches ? "matches" : "DOES NOT MATCH")
+		<< " the reference (mean " << sum / (10.0 * nrValues) << ")\n";
+	return 0;
+}
+
+
+// checks of the renderer against the CPU geometry, run with `./a.out --check` from a directory with the shaders;
+// returns 1 if one fails
+int runChecks() {
+	constexpr unsigned int width = 320, height = 180;
+	constexpr float cameraHeight = 1.2f;
+	const float cameraInclination = glm::radians(10.0f), fovy = 2 * atan(tan(M_PI_4) / width * height);
+	Camera camera{cameraInclination, fovy, width, height};
+	Renderer renderer{width, height, Renderer::Backend::headless, 1};
+	renderer.setCameraParams(camera);
+	renderer.setBackgroundColor({0.2f, 0.3f, 0.3f});
+	renderer.setAnnulusTechnique(Renderer::AnnulusTechnique::procedural);
+	bool passed = true;
+
+	// the annuli generated by the vertex shader against the same whole annuli tessellated on the CPU, below the
+	// transparent distance lines of the scene; only the float rounding of the vertices may move a few edge pixels
+	for (double param : {-0.6, -0.2, -0.02, 0.05, 0.3, 0.6}) {
+		SceneBuilder scene;
+		addDistLines(scene, 2, .01-cameraHeight, 20);
+		auto [sign, d, annuli] = getStreetAnnuli(param, cameraHeight);
+		renderer.loadAnnuli(annuli, {grey()}, {white()});
+		renderer.loadVertices(scene.getVertices(), scene.getStripFirsts(), scene.getStripCounts());
+		std::vector<uint8_t> procedural = renderer.readFrame();
+
+		scene.clear();
+		addStreet(scene, param, cameraHeight, ConstantColor{grey()}, ConstantColor{white()}, camera, 0);
+		addDistLines(scene, 2, .01-cameraHeight, 20);
+		renderer.loadAnnuli({}, {}, {});
+		renderer.loadVertices(scene.getVertices(), scene.getStripFirsts(), scene.getStripCounts());
+		std::vector<uint8_t> vertices = renderer.readFrame();
+
+		size_t nrDifferent = 0;
+		for (size_t i = 0; i != procedural.size(); i += 3) {
+			nrDifferent += !std::equal(&procedural[i], &procedural[i + 3], &vertices[i]);
+		}
+		bool matches = nrDifferent <= width * height / 1000;
+		passed &= matches;
+		std::cout << "Procedural annuli, street " << sign * d / 1000.0 << "m: " << nrDifferent
+			<< " pixels differ from the tessellated street" << (matches ? "" : ", FAILED") << "\n";
+	}
+
+	// visible arcs against whole annuli, also for small rings whose center is inside the visible part of the ground
+	renderer.loadAnnuli({}, {}, {});
+	std::vector<Annulus> rings;
+	for (double param : {-0.6, 0.05, 0.3}) {
+		rings.push_back(std::get<2>(getStreetAnnuli(param, cameraHeight))[0]);
+	}
+	rings.push_back({0, -cameraHeight, -8, 0.5, 0.8, 10000, false});
+	rings.push_back({1.5, -cameraHeight, -20, 0.2, 1.0, 10000, false});
+	for (auto&& ring : rings) {
+		Arc arc = getVisibleArc(ring, camera, 0.25f);
+		std::vector<uint8_t> frames[2];
+		for (bool whole : {false, true}) {
+			SceneBuilder scene;
+			Arc drawn = whole ? Arc{0, 2 * M_PI, ring.resolution} : arc;
+			addArc(scene, ring.x0, ring.y0, ring.z0, ring.internalRadius, ring.externalRadius, drawn.startAngle,
+				drawn.endAngle, drawn.resolution, ConstantColor{white()});
+			renderer.loadVertices(scene.getVertices(), scene.getStripFirsts(), scene.getStripCounts());
+			frames[whole] = renderer.readFrame();
+		}
+		size_t nrDifferent = 0, nrDrawn = 0;
+		for (size_t i = 0; i != frames[0].size(); i += 3) {
+			nrDifferent += !std::equal(&frames[0][i], &frames[0][i + 3], &frames[1][i]);
+			nrDrawn += frames[1][i] == 255;
+		}
+		bool matches = nrDrawn != 0 && nrDifferent <= std::min<size_t>(width * height / 1000, nrDrawn / 20);
+		passed &= matches;
+		std::cout << "Visible arc of the annulus around (" << ring.x0 << ", " << ring.z0 << "), radiuses " << ring.internalRadius
+			<< " to " << ring.externalRadius << ": " << nrDifferent << " of " << nrDrawn << " pixels differ from the whole annulus"
+			<< (matches ? "" : ", FAILED") << "\n";
+	}
+
+	// dashed lines drawn on the visible arcs against the same lines on the whole annuli: the dashes are anchored in the
+	// world, so they start and end on the same vertices and only the float rounding may move a few edge pixels
+	for (double param : {-0.3, 0.05, 0.3}) {
+		std::vector<uint8_t> frames[2];
+		for (bool whole : {false, true}) {
+			SceneBuilder scene;
+			addStreet(scene, param, cameraHeight, ConstantColor{grey()}, alternatingWhite(), camera, whole ? 0 : 0.25f);
+			renderer.loadVertices(scene.getVertices(), scene.getStripFirsts(), scene.getStripCounts());
+			frames[whole] = renderer.readFrame();
+		}
+		size_t nrDifferent = 0, nrDrawn = 0;
+		for (size_t i = 0; i != frames[0].size(); i += 3) {
+			nrDifferent += !std::equal(&frames[0][i], &frames[0][i + 3], &frames[1][i]);
+			nrDrawn += frames[1][i] == 255;
+		}
+		bool matches = nrDrawn != 0 && nrDifferent <= std::min<size_t>(width * height / 1000, nrDrawn / 20);
+		passed &= matches;
+		std::cout << "Dashed lines, street " << param << ": " << nrDifferent << " of " << nrDrawn
+			<< " pixels differ from the lines on the whole annuli" << (matches ? "" : ", FAILED") << "\n";
+	}
+
+	// the SIMD arc packing kernel of this CPU against the scalar one, for lengths leaving every possible remainder
+	{
+		size_t nrDifferent = 0, nrVertices = 0;
+		for (int n : {1, 2, 3, 4, 5, 6, 7, 8, 9, 1001}) {
+			std::vector<double> cosines(n), sines(n);
+			getUnitCircle(0.3, 0.01, n, cosines.data(), sines.data());
+			std::vector<PackedVertex> expected(2*n), actual(2*n);
+			PackedVertex colored{0, -1.2f, 0, {0.2f, 0.4f, 0.6f, 0.8f}};
+			packArcScalar(cosines.data(), sines.data(), n, 1000.5, -3.25, 995, 1005, colored, expected.data());
+			packArc(cosines.data(), sines.data(), n, 1000.5, -3.25, 995, 1005, colored, actual.data());
+			for (int i = 0; i != 2*n; ++i) {
+				nrDifferent += std::memcmp(&expected[i], &actual[i], sizeof(PackedVertex)) != 0;
+			}
+			nrVertices += 2*n;
+		}
+		bool matches = nrDifferent == 0;
+		passed &= matches;
+		std::cout << "Arc packing: " << nrDifferent << " of " << nrVertices << " vertices differ from the scalar kernel"
+			<< (matches ? "" : ", FAILED") << "\n";
+	}
+
+	// grey screenshots against the luma of the RGB frame (like cv2.cvtColor), colored background and distance lines included
+	{
+		SceneBuilder scene;
+		addStreet(scene, 0.3, cameraHeight, ConstantColor{grey()}, ConstantColor{white()}, camera, 0.25f);
+		addDistLines(scene, 2, .01-cameraHeight, 20);
+		renderer.loadVertices(scene.getVertices(), scene.getStripFirsts(), scene.getStripCounts());
+		std::vector<uint8_t> rgb = renderer.readFrame(Renderer::ScreenshotFormat::rgb);
+		std::vector<uint8_t> grey = renderer.readFrame(Renderer::ScreenshotFormat::grey);
+		size_t nrDifferent = 0;
+		int maxDifference = 0;
+		for (size_t i = 0; i != grey.size(); ++i) {
+			int luma = (rgb[3*i] * 4899 + rgb[3*i + 1] * 9617 + rgb[3*i + 2] * 1868 + (1 << 13)) >> 14; // cv2 fixed point
+			nrDifferent += grey[i] != luma;
+			maxDifference = std::max(maxDifference, std::abs(grey[i] - luma));
+		}
+		bool matches = maxDifference <= 1;
+		passed &= matches;
+		std::cout << "Grey screenshot: " << nrDifferent << " pixels differ from the luma of the RGB frame, by at most "
+			<< maxDifference << (matches ? "" : ", FAILED") << "\n";
+	}
+
+	std::cout << (passed ? "All checks passed\n" : "SOME CHECKS FAILED\n");
+	return passed ? 0 : 1;
 }
 
 
 int main(int argc, char const* argv[]) {
+	if (argc > 1 && std::string{argv[1]} == "--benchmark") {
+		return runBenchmarks();
+	}
+	if (argc > 1 && std::string{argv[1]} == "--check") {
+		return runChecks();
+	}
+	// `--shard i/N` generates only the i-th (from 0) of N slices of the sweep into its own directory, e.g. on one of N
+	// machines sharing the same params.json; `--merge` then checks that the parts hold every sample once and indexes them
+	size_t part = 0, nrParts = 1;
+	bool sharded = false, merge = false;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--shard" && i + 1 < argc) {
+			unsigned long first, second;
+			char end;
+			if (std::sscanf(argv[++i], "%lu/%lu%c", &first, &second, &end) != 2 || first >= second) {
+				throw std::invalid_argument("--shard needs i/N with 0 <= i < N");
+			}
+			part = first;
+			nrParts = second;
+			sharded = true;
+		} else if (arg == "--merge") {
+			merge = true;
+		} else {
+			throw std::invalid_argument("Unknown argument " + arg);
+		}
+	}
+
 	auto params = json::parse(getFileContent("../params.json"));
 
 	int width = params["width"];
@@ -435,6 +2914,45 @@ int main(int argc, char const* argv[]) {
 	float cameraHeight = params["cameraHeight"]; // meters
 	float cameraInclination = glm::radians((float) params["cameraInclination"]);
 	std::string datasetPath = params["datasetPath"];
+	bool headless = params.value("backend", "window") == "headless";
+	bool capture = params.value("capture", headless); // a headless run is pointless without saving screenshots
+	size_t readbackRingSize = params.value("readbackRingSize", 3);
+	// screenshots are encoded and written in the background while the next frames are drawn; 0 to do it in the render loop
+	size_t encoderThreads = params.value("encoderThreads", std::max(std::thread::hardware_concurrency(), 2u) - 1);
+	size_t encoderQueueSize = params.value("encoderQueueSize", 8); // frames waiting for an encoder, at most
+	std::string streetGeometry = params.value("streetGeometry", "vertices"); // "vertices", "procedural" or "raycast"
+	float maxTessellationError = params.value("maxTessellationError", 0.25f); // pixels, <= 0 to tessellate whole annuli
+	Renderer::ScreenshotSettings screenshotSettings;
+	screenshotSettings.compressionLevel = params.value("pngCompressionLevel", 1); // 0 (uncompressed) to 9
+	std::string screenshotFormat = params.value("screenshotFormat", "rgb"); // "rgb", "grey" or "palette"
+	screenshotSettings.format = screenshotFormat == "grey" ? Renderer::ScreenshotFormat::grey
+		: screenshotFormat == "palette" ? Renderer::ScreenshotFormat::palette : Renderer::ScreenshotFormat::rgb;
+	screenshotSettings.directIo = params.value("directIo", false);
+	screenshotSettings.fileFormat = params.value("fileFormat", "png") == "qoi" ? Renderer::FileFormat::qoi : Renderer::FileFormat::png;
+	// "files" writes an image per sample, named after its label; "shards" appends them to a few large files (DatasetWriter);
+	// "tensors" writes raw .npy arrays of up to `tensorSamples` samples (TensorDatasetWriter), also with the street
+	// rectangles of image_manipulator.py if `exportStreetRects`
+	std::string datasetFormat = params.value("datasetFormat", "files");
+	size_t samplesPerShard = params.value("samplesPerShard", 10000);
+	bool exportStreetRects = params.value("exportStreetRects", false);
+	// every random choice of a sample is drawn from RandomKey{seed, sample index, stream}, see SampleLabel::sample
+	uint64_t seed = params.value("seed", (uint64_t) 0);
+	// the samples to generate, as fast as possible; a window without capture shows them over and over
+	Sweep sweep{params.value("sweep", json::object()), seed, cameraHeight, cameraInclination};
+	if (merge) {
+		return mergeParts(datasetPath, datasetFormat, sweep.getNrSamples());
+	}
+	// the samples of this part, a contiguous slice of the sweep
+	const uint64_t firstSample = part * sweep.getNrSamples() / nrParts, endSample = (part + 1) * sweep.getNrSamples() / nrParts;
+	if (sharded) {
+		datasetPath = getPartDirectory(datasetPath, part, nrParts);
+	}
+	size_t tensorSamples = params.value("tensorSamples", endSample - firstSample);
+	double progressInterval = params.value("progressInterval", 5.0); // seconds between progress reports
+	bool proceduralStreet = streetGeometry != "vertices"; // generated on the GPU
+	if (proceduralStreet && sweep.hasStreetNoise()) {
+		throw std::invalid_argument("Noisy streets need \"streetGeometry\": \"vertices\", the GPU draws constant colors");
+	}
 
 	float fovx = glm::radians((float) params["fovx"]);
 	float fovy = 2 * atan(tan(fovx/2) / width * height);
@@ -444,25 +2962,107 @@ int main(int argc, char const* argv[]) {
 
 	std::vector<float> lineVertices = getProjLines((float)width/height, cameraInclination, fovy, {1.0, 0.0, 0.0});
 
-	Renderer renderer{width, height};
-	renderer.setCameraParams(cameraInclination, fovy);
+	std::filesystem::create_directories(datasetPath);
+	std::unique_ptr<DatasetWriter> dataset; // both outlive the renderer, whose encoder threads append to them
+	std::unique_ptr<TensorDatasetWriter> tensorDataset;
+	if (datasetFormat == "shards") {
+		dataset = std::make_unique<DatasetWriter>(datasetPath, samplesPerShard, width, height,
+			(uint8_t) screenshotSettings.fileFormat, (uint8_t) screenshotSettings.format);
+	} else if (datasetFormat == "tensors") {
+		StreetRect streetRect;
+		if (exportStreetRects) {
+			if (!sweep.hasFixedCamera()) {
+				throw std::invalid_argument("Street rectangles can only be exported if the camera of all the jobs is the same");
+			}
+			streetRect = getStreetRect(width, height, cameraInclination, fovy, params["upperRectLineHeight"], params["profileWidth"]);
+		}
+		unsigned int channels = screenshotSettings.format == Renderer::ScreenshotFormat::grey ? 1 : 3;
+		tensorDataset = std::make_unique<TensorDatasetWriter>(datasetPath, tensorSamples, width, height, channels, streetRect);
+	}
+
+	Renderer renderer{(unsigned int) width, (unsigned int) height,
+		headless ? Renderer::Backend::headless : Renderer::Backend::window, readbackRingSize, encoderThreads, encoderQueueSize};
+	Camera camera{cameraInclination, fovy, (unsigned int) width, (unsigned int) height};
+	renderer.setCameraParams(camera);
 	renderer.setBackgroundColor(backgroundColor);
+	renderer.setScreenshotSettings(screenshotSettings);
+	renderer.setDataset(dataset.get());
+	renderer.setTensorDataset(tensorDataset.get());
+	renderer.setAnnulusTechnique(streetGeometry == "raycast" ? Renderer::AnnulusTechnique::raycast : Renderer::AnnulusTechnique::procedural);
 	//renderer.loadLineVertices(lineVertices);
 
-	std::filesystem::create_directories(datasetPath);
-	while(!renderer.shouldClose()) {
-		auto [sign, d, street] = getStreet(sin(glfwGetTime()/4)/1.5, cameraHeight, grey, white);
-		auto dist = getDistLines(2, .01-cameraHeight, 20);
-		renderer.loadVertices(merge({street, dist}));
-
-		//std::stringstream filename{};
-		//filename << datasetPath << "/" << (sign == -1 ? "-" : "") << std::setfill('0') << std::setw(9) << d << ".png";
-		//renderer.screenshot(filename.str());
+	auto startTime = std::chrono::steady_clock::now();
+	auto getTime = [&startTime]() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	};
 
-		//if (glfwGetTime()/20 > (2*M_PI)) {
-		//	break;
-		//}
+	SceneBuilder scene;
+	const size_t nrSamples = endSample - firstSample;
+	size_t nrScreenshots = 0;
+	double nextProgressTime = progressInterval;
+	std::cout << "Sweep: " << nrSamples << " samples";
+	if (sharded) {
+		std::cout << " (" << firstSample << " to " << endSample - 1 << ", part " << part << " of " << nrParts << ")";
+	}
+	std::cout << "\n";
+	for (uint64_t i = 0; nrSamples != 0 && !renderer.shouldClose(); ++i) {
+		if (capture && (i == nrSamples || (tensorDataset && nrScreenshots == tensorDataset->getCapacity()))) {
+			break;
+		}
+		SampleJob job = sweep.getJob(firstSample + i % nrSamples);
+		if (job.cameraInclination != camera.inclination) {
+			camera.inclination = job.cameraInclination;
+			renderer.setCameraParams(camera);
+		}
 
-		renderer.draw();
+		scene.clear();
+		int sign, d;
+		if (proceduralStreet) {
+			std::vector<Annulus> annuli;
+			std::tie(sign, d, annuli) = getStreetAnnuli(job.streetParam, job.cameraHeight);
+			renderer.loadAnnuli(annuli, {grey()}, {white()});
+		} else if (job.streetNoise > 0) {
+			std::tie(sign, d) = addStreet(scene, job.streetParam, job.cameraHeight,
+				randomGrey(seed, job.sample, job.streetNoise), ConstantColor{white()}, camera, maxTessellationError);
+		} else {
+			std::tie(sign, d) = addStreet(scene, job.streetParam, job.cameraHeight,
+				ConstantColor{grey()}, ConstantColor{white()}, camera, maxTessellationError);
+		}
+		addDistLines(scene, 2, .01-job.cameraHeight, 20);
+		renderer.loadVertices(scene.getVertices(), scene.getStripFirsts(), scene.getStripCounts());
+
+		if (capture) {
+			std::stringstream filename{};
+			filename << datasetPath << "/" << (sign == -1 ? "-" : "") << std::setfill('0') << std::setw(9) << d
+				<< Renderer::getFileExtension(screenshotSettings.fileFormat);
+			renderer.screenshot(filename.str(), {sign * d / 1000.0, job.cameraHeight, job.cameraInclination, fovy, job.sample});
+			++nrScreenshots;
+
+			if (double time = getTime(); progressInterval > 0 && time >= nextProgressTime) {
+				double rate = nrScreenshots / time;
+				std::ostringstream progress;
+				progress << std::fixed << std::setprecision(1) << "Progress: " << nrScreenshots << "/" << nrSamples
+					<< " samples (" << 100.0 * nrScreenshots / nrSamples << "%), " << rate << " samples/s, "
+					<< (nrSamples - nrScreenshots) / rate << "s left\n";
+				std::cout << progress.str() << std::flush;
+				nextProgressTime = time + progressInterval;
+			}
+		} else {
+			renderer.draw();
+		}
+	}
+	renderer.flushScreenshots();
+	if (capture) {
+		double time = getTime();
+		std::cout << "Generated " << nrScreenshots << " samples in " << time << "s (" << nrScreenshots / time << " samples/s)\n";
+	}
+	if (dataset) {
+		dataset->close();
+		std::cout << "Dataset: " << dataset->getNrSamples() << " samples in " << dataset->getNrShards() << " shards\n";
+	}
+	if (tensorDataset) {
+		tensorDataset->close();
+		std::cout << "Dataset: " << tensorDataset->getNrSamples() << " samples in tensors\n";
 	}
+	scene.printReport();
 }
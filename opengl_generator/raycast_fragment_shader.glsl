@@ -0,0 +1,76 @@
+#version 330 core
+
+// draws horizontal annuli exactly, intersecting the camera ray of every pixel with the plane of each annulus.
+// The center of an annulus is given as a direction and a distance from the camera, and the radii as offsets
+// from that distance, so that huge radii do not lose precision in the difference between the two
+
+#define MAX_ANNULI 8
+
+uniform int nrAnnuli;
+uniform vec2 centerDirection[MAX_ANNULI]; // normalized (x, z) direction from the camera to the center
+uniform float centerDistance[MAX_ANNULI];
+uniform vec2 radiusOffsets[MAX_ANNULI];   // (internal, external) radius minus centerDistance
+uniform float planeY[MAX_ANNULI];
+uniform int resolution[MAX_ANNULI];       // number of segments, only used for dashes
+uniform vec4 color[MAX_ANNULI];
+uniform int dashLength[MAX_ANNULI];       // visible segments in every dash period
+uniform int dashPeriod[MAX_ANNULI];       // in segments, 0 for a continuous annulus
+
+uniform mat4 inverseViewProjection;
+uniform mat4 view;
+uniform vec2 screenSize;
+uniform float far; // same far plane as the rasterized geometry
+
+out vec4 outColor;
+
+void main() {
+	vec2 ndc = gl_FragCoord.xy / screenSize * 2.0 - 1.0;
+	vec4 nearPoint = inverseViewProjection * vec4(ndc, -1.0, 1.0);
+	vec4 farPoint = inverseViewProjection * vec4(ndc, 1.0, 1.0);
+	vec3 direction = farPoint.xyz / farPoint.w - nearPoint.xyz / nearPoint.w; // the camera is in the origin
+
+	vec4 result = vec4(0.0);
+	for (int i = 0; i != nrAnnuli; ++i) {
+		if (direction.y * planeY[i] <= 0.0) {
+			continue; // looking away from the plane
+		}
+		vec3 hit = direction * (planeY[i] / direction.y);
+		if (-(view * vec4(hit, 1.0)).z > far) {
+			continue;
+		}
+
+		// distance of the hit point from the circle of radius centerDistance, without cancellation:
+		// |p-c| - R = (|p|^2 - 2R p.u) / (|p-c| + R)
+		vec2 p = hit.xz;
+		float R = centerDistance[i];
+		float pu = dot(p, centerDirection[i]);
+		float numerator = dot(p, p) - 2.0 * R * pu;
+		float offset = numerator / (sqrt(max(R*R - 2.0*R*pu + dot(p, p), 0.0)) + R);
+
+		vec2 radii = radiusOffsets[i];
+		if (offset < min(radii.x, radii.y) || offset > max(radii.x, radii.y)) {
+			continue;
+		}
+
+		if (dashPeriod[i] != 0) {
+			// angle of p around the center, as the angle of -u plus the small deviation of p from it
+			vec2 u = centerDirection[i];
+			float deviation = atan(u.y * p.x - u.x * p.y, R - pu);
+			float angle = mod(atan(-u.y, -u.x) + deviation, 6.283185307179586);
+			int segment = int(angle / 6.283185307179586 * float(resolution[i]));
+			if (segment % dashPeriod[i] >= dashLength[i]) {
+				continue;
+			}
+		}
+
+		// "over" compositing, annuli are drawn in order like the rasterized ones
+		vec4 c = color[i];
+		result.rgb = c.rgb * c.a + result.rgb * (1.0 - c.a);
+		result.a = c.a + result.a * (1.0 - c.a);
+	}
+
+	if (result.a == 0.0) {
+		discard;
+	}
+	outColor = vec4(result.rgb / result.a, result.a);
+}
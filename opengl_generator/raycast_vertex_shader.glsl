@@ -0,0 +1,7 @@
+#version 330 core
+
+// triangle covering the whole screen, generated from gl_VertexID: draw it with 3 vertices and no buffers
+
+void main() {
+	gl_Position = vec4(gl_VertexID == 1 ? 3.0 : -1.0, gl_VertexID == 2 ? 3.0 : -1.0, 0.0, 1.0);
+}
@@ -3,7 +3,7 @@
 in vec3 pos;
 in vec4 col;
 
-out vec4 fragCol;
+flat out vec4 fragCol; // strips are drawn with the color of the first vertex of each triangle
 
 uniform mat4 view;
 uniform mat4 projection;
@@ -1,21 +1,53 @@
 
 import os
 import random
+from functools import partial
 from math import tan, cos, pi, inf
 from tensorflow import keras
 import numpy as np
 import cv2
 import image_manipulator as im
+import dataset as ds
 
 def getFiles(path):
     files = []
     for f in os.listdir(path):
         filePath = os.path.join(path, f)
-        if len(f) > 4 and f[-4:] == ".png" and os.path.isfile(filePath):
+        if len(f) > 4 and f[-4:] in [".png", ".qoi"] and os.path.isfile(filePath):
             files.append((filePath, int(f[:-4])/1000))
     random.shuffle(files)
     return files
 
+def readImage(path):
+    """reads a PNG or QOI screenshot (see "fileFormat" in params.json) as a BGR image, like cv2.imread"""
+    if path.endswith(".qoi"):
+        import qoi # OpenCV cannot read QOI files
+        return cv2.cvtColor(qoi.read(path), cv2.COLOR_RGB2BGR)
+    return cv2.imread(path)
+
+def getSamples(path):
+    """returns (function reading the image, function reading the street rectangle or None, radius) triplets in random
+    order, from the merged parts, the tensors or the shards in the directory if there are any (see dataset.py),
+    otherwise from the images named after their radius"""
+    merged = ds.openIndex(path)
+    tensors = ds.openTensors(path) if merged is None else None
+    shards = ds.openShards(path) if merged is None and tensors is None else []
+    if merged is not None:
+        index, parts = merged
+        samples = [(partial(parts[p].image, r), partial(parts[p].streetRect, r) if parts[p].hasStreetRects() else None,
+                    radius) for p, r, radius in zip(index["part"].tolist(), index["record"].tolist(), index["radius"])]
+    elif tensors is not None:
+        images, labels, streetRects = tensors
+        samples = [(partial(ds.readTensor, images, i), None if streetRects is None else partial(ds.readTensor, streetRects, i),
+                    labels[i, 0]) for i in range(len(images))]
+    elif shards:
+        samples = [(partial(shard.image, i), None, radius)
+                   for shard in shards for i, radius in enumerate(shard.index["radius"])]
+    else:
+        return [(partial(readImage, filePath), None, radius) for filePath, radius in getFiles(path)]
+    random.shuffle(samples)
+    return samples
+
 def getProjectedRoadDistance(cameraInclination, cameraHeight, fovy):
     """returns the distance from the camera to the street at the very bottom of the screen"""
     return 2 * cameraHeight * tan(pi/2 - cameraInclination - fovy/2)
@@ -35,10 +67,12 @@ def getTrainingSamples(p):
 
     print(projectedRoadWidth, projectedRoadDistance, projectedRoadDistancePixels)
 
-    for path, realRadius in getFiles(p.datasetPath):
-        img = cv2.imread(path)
-        _, rect = im.getStreetRect(img, p.cameraInclination, p.fovy,
-                                   p.upperRectLineHeight, p.profileWidth)
+    for readFrame, readStreetRect, realRadius in getSamples(p.datasetPath):
+        if readStreetRect is not None: # already warped by the generator
+            rect = readStreetRect()
+        else:
+            _, rect = im.getStreetRect(readFrame(), p.cameraInclination, p.fovy,
+                                       p.upperRectLineHeight, p.profileWidth)
 
         if (realRadius > 3/2*radiuses[0]/p.profileWidth*projectedRoadWidth
                 or realRadius < 3/2*radiuses[-1]/p.profileWidth*projectedRoadWidth):